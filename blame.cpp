@@ -0,0 +1,62 @@
+// wait-time blame: the time threads spend waiting for a lock is charged to
+// the threads holding it meanwhile, by the callsite of their acquire and the
+// critical section pattern it was held in (see blame_scanner), so the
+// sections that keep others waiting longest can be shrunk first
+#include "parser.h"
+
+#include <map>
+#include <algorithm> // sort()
+
+namespace lktrace {
+
+void parser::find_blame () {
+	blame.clear();
+	blame_pats = pattern_table();
+	// blame index, key=object id, caller id, pattern id
+	std::map<std::tuple<uint32_t, uint32_t, uint32_t>, size_t> ids;
+	blame_scanner B (thrds.size());
+	scan_global([&] (const event_store& E, size_t i) {
+		uint32_t t = E.thrd[i];
+		if (!B.add(E.ev[i], t, E.obj[i], E.caller[i], E.ts[i])) return;
+		section_scanner& S = B.thrds[t].section;
+		if (!B.thrds[t].released.empty()) {
+			uint32_t pat = blame_pats.intern(S.pattern.data(), S.pattern.size(), S.hash);
+			for (auto& h : B.thrds[t].released) {
+				auto r = ids.emplace(std::make_tuple(h.obj, h.caller, pat), blame.size());
+				if (r.second) blame.push_back({h.obj, h.caller, pat, 0, 0, 0, 0});
+				blame_stats& b = blame[r.first->second];
+				b.ticks += h.ticks;
+				++b.holds;
+				b.waits += h.blocked.size();
+				b.max = std::max(b.max, h.ticks);
+			}
+		}
+		B.reset(t);
+	});
+	std::sort(blame.begin(), blame.end(), [] (const blame_stats& a, const blame_stats& b) {
+		if (a.ticks != b.ticks) return a.ticks > b.ticks;
+		if (a.obj != b.obj) return a.obj < b.obj;
+		if (a.caller != b.caller) return a.caller < b.caller;
+		return a.pattern < b.pattern;
+	});
+}
+
+void parser::dump_blame (std::ostream& outs) {
+	for (size_t k = 0; k < blame.size(); ++k) {
+		const blame_stats& b = blame[k];
+		outs << "Blocker #" << std::dec << k + 1 << ": lock 0x" << std::hex << objs[b.obj];
+		put_obj_pid(outs, b.obj);
+		outs << " held @" << caller_names[b.caller] << " [0x" << std::hex << callers[b.caller] << "]\n";
+		outs << std::dec << "\tkept threads waiting " << to_ns(b.ticks) << " ns in "
+			<< b.holds << " hold(s), " << b.waits << " wait(s), worst hold "
+			<< to_ns(b.max) << " ns\n";
+		outs << "\tin section:\n";
+		const pat_elem* sig = blame_pats.seq(b.pattern);
+		for (size_t a = 0; a < blame_pats.len(b.pattern); ++a)
+			outs << "\t\t" << ev_to_descr(sig[a].ev) << " @" << caller_names[sig[a].caller]
+				<< " [0x" << std::hex << callers[sig[a].caller] << "]\n";
+		outs << std::dec << '\n';
+	}
+}
+
+} // namespace lktrace
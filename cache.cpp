@@ -0,0 +1,223 @@
+// sidecar cache of a loaded trace
+// the first load of a trace writes the decoded event store, the global and
+// per-object orders and the symbols next to it (trace name + CACHE_SUFFIX);
+// later loads map the cache and copy the columns out instead of parsing
+//
+// the cache is laid out as cache_header, then the sections listed by
+// parser::cache_sections() back to back (each zero-padded to a multiple of
+// 8 bytes), then the global order
+// it is only used if the trace size, mtime and hash match the header
+#include "parser.h"
+#include "parallel.h"
+
+#include <fcntl.h> // open()
+#include <unistd.h> // close()
+#include <sys/mman.h> // mmap()
+#include <sys/stat.h> // fstat()
+#include <stdio.h> // rename()
+
+#define CACHE_MAGIC "LKCACHE" // includes terminator (8 bytes)
+// bump when the layout or the meaning of any section changes
+#define CACHE_VERSION 3
+// bytes hashed at each end of the trace
+#define CACHE_HASH_SPAN (64 << 10)
+
+namespace lktrace {
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t word; // sizeof(size_t)
+	cache_key key;
+	uint64_t n_events;
+	uint64_t n_thrds;
+	uint64_t n_objs;
+	uint64_t n_callers;
+	uint64_t arena_sz;
+	uint64_t n_cct; // calling context nodes (0 = no stacks)
+	uint64_t n_topo; // cpus in the topology (0 = no cpu ids)
+	file_header hdr;
+};
+
+static size_t pad8 (size_t n) {return (n + 7) & ~(size_t) 7;}
+
+// FNV-1a over the first and last CACHE_HASH_SPAN bytes and the size
+// hashing the whole trace would cost as much as parsing it; the ends catch
+// a rewritten trace whose size and mtime happen to match
+uint64_t trace_hash (const char* buf, size_t sz) {
+	uint64_t h = 0xcbf29ce484222325;
+	auto mix = [&h] (const char* p, size_t n) {
+		for (size_t k = 0; k < n; ++k) {
+			h ^= (uint8_t) p[k];
+			h *= 0x100000001b3;
+		}
+	};
+	size_t head = std::min<size_t>(sz, CACHE_HASH_SPAN);
+	mix(buf, head);
+	size_t tail = std::min<size_t>(sz - head, CACHE_HASH_SPAN);
+	mix(buf + sz - tail, tail);
+	mix((const char*) &sz, sizeof(size_t));
+	return h;
+}
+
+// call f(data, bytes) for each cached section, in file order
+// the containers must already have their cached sizes
+template <class F> void parser::cache_sections (F f,
+		std::vector<std::pair<uint64_t, uint64_t> >& names) {
+	f(store.ts.data(), store.size() * sizeof(size_t));
+	f(store.ev.data(), store.size() * sizeof(event));
+	f(store.obj.data(), store.size() * sizeof(uint32_t));
+	f(store.caller.data(), store.size() * sizeof(uint32_t));
+	f(store.thrd.data(), store.size() * sizeof(uint32_t));
+	f(store.ctx.data(), store.ctx.size() * sizeof(uint32_t));
+	f(cct.data(), cct.size() * sizeof(cct_node));
+	f(store.cpu.data(), store.cpu.size() * sizeof(uint16_t));
+	f(topo.data(), topo.size() * sizeof(cpu_topo));
+	f(thrds.data(), thrds.size() * sizeof(thrd_info));
+	f(objs.data(), objs.size() * sizeof(size_t));
+	f(callers.data(), callers.size() * sizeof(size_t));
+	f(caller_xref.data(), caller_xref.size() * sizeof(uint32_t));
+	f(lk_begin.data(), lk_begin.size() * sizeof(size_t));
+	f(lk_hist.data(), lk_hist.size() * sizeof(size_t));
+	// offset and length in the arena of each caller name, then each hook
+	f(names.data(), names.size() * sizeof(names[0]));
+	f(sym_arena.data(), sym_arena.size());
+}
+
+// write the cache for the loaded trace to fname
+// the cache is best effort, so failures (eg. a read-only directory) are ignored
+void parser::save_cache (const std::string& fname, const cache_key& key) {
+	cache_header ch;
+	memset(&ch, 0, sizeof(cache_header));
+	memcpy(ch.magic, CACHE_MAGIC, sizeof(ch.magic));
+	ch.version = CACHE_VERSION;
+	ch.word = sizeof(size_t);
+	ch.key = key;
+	ch.n_events = store.size();
+	ch.n_thrds = thrds.size();
+	ch.n_objs = objs.size();
+	ch.n_callers = callers.size();
+	ch.arena_sz = sym_arena.size();
+	ch.n_cct = cct.size();
+	ch.n_topo = topo.size();
+	ch.hdr = hdr;
+
+	std::vector<std::pair<uint64_t, uint64_t> > names;
+	auto ref = [this, &names] (std::string_view s) {
+		if (s.empty()) names.emplace_back(0, 0);
+		else names.emplace_back(s.data() - sym_arena.data(), s.size());
+	};
+	for (std::string_view s : caller_names) ref(s);
+	for (std::string_view s : thrd_hooks) ref(s);
+	build_global();
+
+	// written under a temporary name, so a concurrent run never maps
+	// a partial cache
+	std::string tmp = fname + ".tmp";
+	std::ofstream out (tmp, std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) return;
+	const char zeros[8] = {};
+	auto put = [&out, &zeros] (const void* p, size_t n) {
+		out.write((const char*) p, n);
+		out.write(zeros, pad8(n) - n);
+	};
+	put(&ch, sizeof(cache_header));
+	cache_sections(put, names);
+	put(global_hist.data(), global_hist.size() * sizeof(size_t));
+	out.close();
+	if (out.fail() || rename(tmp.c_str(), fname.c_str()) != 0) unlink(tmp.c_str());
+	// the global order is only kept if it is used (see build_global())
+	std::vector<size_t>().swap(global_hist);
+}
+
+// load the trace from the cache at fname, if it matches key
+// returns false (loading nothing) if there is no valid cache
+bool parser::load_cache (const std::string& fname, const cache_key& key) {
+	int fd = open(fname.c_str(), O_RDONLY);
+	if (fd == -1) return false;
+	struct stat info;
+	int e = fstat(fd, &info);
+	size_t sz = (e == 0) ? (size_t) info.st_size : 0;
+	const char* p = nullptr;
+	if (sz >= sizeof(cache_header))
+		p = (const char*) mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == nullptr || p == MAP_FAILED) return false;
+
+	cache_header ch;
+	memcpy(&ch, p, sizeof(cache_header));
+	if (memcmp(ch.magic, CACHE_MAGIC, sizeof(ch.magic)) != 0
+			|| ch.version != CACHE_VERSION || ch.word != sizeof(size_t)
+			|| memcmp(&ch.key, &key, sizeof(cache_key)) != 0) {
+		munmap((void*) p, sz);
+		return false;
+	}
+
+	size_t n = ch.n_events;
+	store.with_ctx = ch.n_cct > 0;
+	store.with_cpu = ch.n_topo > 0;
+	store.resize(n);
+	cct.resize(ch.n_cct);
+	topo.resize(ch.n_topo);
+	thrds.resize(ch.n_thrds);
+	objs.resize(ch.n_objs);
+	callers.resize(ch.n_callers);
+	caller_xref.resize(ch.n_callers);
+	lk_begin.resize(ch.n_objs + 1);
+	lk_hist.resize(n);
+	std::vector<std::pair<uint64_t, uint64_t> > names (ch.n_callers + ch.n_thrds);
+	sym_arena.resize(ch.arena_sz);
+
+	// the columns are large, so copy the sections in parallel
+	struct section {
+		void* dst;
+		size_t off;
+		size_t bytes;
+	};
+	std::vector<section> sections;
+	size_t off = pad8(sizeof(cache_header));
+	cache_sections([&sections, &off] (void* dst, size_t bytes) {
+		sections.push_back({dst, off, bytes});
+		off += pad8(bytes);
+	}, names);
+	if (off + n * sizeof(size_t) != sz) { // not a whole cache
+		store = event_store();
+		cct.clear();
+		topo.clear();
+		thrds.clear();
+		objs.clear();
+		callers.clear();
+		caller_xref.clear();
+		lk_begin.clear();
+		lk_hist.clear();
+		sym_arena.clear();
+		munmap((void*) p, sz);
+		return false;
+	}
+	// each section's pages are dropped once copied, so the cache is not
+	// resident alongside the copies
+	size_t page = sysconf(_SC_PAGESIZE);
+	parallel_for(sections.size(), [&] (size_t s) {
+		memcpy(sections[s].dst, p + sections[s].off, sections[s].bytes);
+		size_t begin = (sections[s].off + page - 1) & ~(page - 1);
+		size_t end = (sections[s].off + sections[s].bytes) & ~(page - 1);
+		if (begin < end) madvise((void*) (p + begin), end - begin, MADV_DONTNEED);
+	});
+
+	hdr = ch.hdr;
+	for (size_t t = 0; t < thrds.size(); ++t) thrd_ind.emplace(thrds[t].tid, t);
+	auto name = [this] (const std::pair<uint64_t, uint64_t>& r) {
+		return std::string_view(sym_arena.data() + r.first, r.second);
+	};
+	for (size_t c = 0; c < callers.size(); ++c) caller_names.push_back(name(names[c]));
+	for (size_t t = 0; t < thrds.size(); ++t)
+		thrd_hooks.push_back(name(names[callers.size() + t]));
+
+	// the global order is copied out on first use
+	cache_buf = p;
+	cache_sz = sz;
+	cache_global = (const size_t*) (p + off);
+	return true;
+}
+
+} // namespace lktrace
@@ -0,0 +1,241 @@
+// timeline export in the Trace Event Format (JSON), for chrome://tracing
+// and Perfetto: lock waits and holds and condvar waits are duration slices
+// on each thread, signals are zero-length slices, and a signal that woke a condvar
+// wait is a flow arrow to the end of the wait
+// slices on one track must nest, but a condvar wait begins before the
+// release of its mutex's hold, and hand-over-hand holds overlap, so a slice
+// that does not nest in a thread's own track goes to another track of the
+// thread (see lanes)
+// the events are written as they are scanned, through a buffer, so the
+// output is never held in memory; over the event budget, the shortest
+// slices are dropped
+#include "parser.h"
+
+#include <charconv> // to_chars()
+#include <algorithm> // lower_bound()
+
+// output buffered before writing it to the stream
+#define CHROME_BUF (1 << 20)
+
+namespace lktrace {
+
+// buffered JSON text
+class json_out {
+	std::ostream& outs;
+	std::string buf;
+
+	void check () {if (buf.size() >= CHROME_BUF) flush();}
+
+	public:
+	json_out (std::ostream& outs) : outs(outs) {buf.reserve(CHROME_BUF + 4096);}
+	~json_out () {flush();}
+
+	void flush () {
+		outs.write(buf.data(), buf.size());
+		buf.clear();
+	}
+
+	json_out& operator<< (std::string_view s) {
+		buf.append(s);
+		check();
+		return *this;
+	}
+
+	json_out& operator<< (size_t v) {
+		char tmp[24];
+		buf.append(tmp, std::to_chars(tmp, tmp + sizeof(tmp), v).ptr);
+		return *this;
+	}
+
+	json_out& hex (size_t v) {
+		char tmp[24];
+		buf += "0x";
+		buf.append(tmp, std::to_chars(tmp, tmp + sizeof(tmp), v, 16).ptr);
+		return *this;
+	}
+
+	// ns as microseconds, the format's time unit
+	json_out& usec (size_t ns) {
+		*this << ns / 1000;
+		char frac[5] = {'.', (char) ('0' + ns / 100 % 10), (char) ('0' + ns / 10 % 10),
+			(char) ('0' + ns % 10), 0};
+		buf += frac;
+		return *this;
+	}
+
+	// quoted string
+	json_out& str (std::string_view s) {
+		buf += '"';
+		for (char c : s) {
+			if (c == '"' || c == '\\') buf += '\\';
+			if ((unsigned char) c < 0x20) {
+				const char* digits = "0123456789abcdef";
+				buf += "\\u00";
+				buf += digits[c >> 4];
+				buf += digits[c & 0xf];
+				continue;
+			}
+			buf += c;
+		}
+		buf += '"';
+		check();
+		return *this;
+	}
+};
+
+// log-linear buckets of slice durations (16 per power of 2), for choosing
+// the shortest slice kept within the budget
+static size_t dur_bucket (size_t v) {
+	if (v < 16) return v;
+	unsigned e = 63 - __builtin_clzll(v);
+	return (e - 3) * 16 + ((v >> (e - 4)) & 15);
+}
+
+// least duration in bucket b
+static size_t dur_bucket_min (size_t b) {
+	if (b < 16) return b;
+	return (16 + b % 16) << (b / 16 - 1);
+}
+
+// the tracks of one thread, its own first; a slice goes on the first one it
+// nests in, or on a new one
+// each track keeps its outermost slices (begin and end), which are disjoint
+// and in time order, since slices are placed in the order they end
+struct lanes {
+	std::vector<std::vector<std::pair<size_t, size_t> > > top;
+	std::vector<size_t> tids; // of each track
+
+	// track of the slice from begin to end, which ends no earlier than the
+	// slices placed so far (SIZE_MAX if it needs a new one)
+	size_t place (size_t begin, size_t end) {
+		for (size_t l = 0; l < top.size(); ++l) {
+			auto& T = top[l];
+			// the slices beginning at or after begin nest in this one, and
+			// the one before it must end by begin
+			auto it = std::lower_bound(T.begin(), T.end(), std::make_pair(begin, (size_t) 0));
+			if (it != T.begin() && std::prev(it)->second > begin) continue;
+			T.erase(it, T.end());
+			T.emplace_back(begin, end);
+			return l;
+		}
+		top.emplace_back(1, std::make_pair(begin, end));
+		return SIZE_MAX;
+	}
+
+	// no later slice begins before the ones placed so far end
+	void clear () {
+		for (auto& T : top) T.clear();
+	}
+};
+
+// write the trace's lock timeline to outs as Trace Event Format JSON, with
+// at most budget events (0 = no limit) besides the process and thread names
+void parser::export_chrome (std::ostream& outs, size_t budget) {
+	// over budget, find the shortest slice duration that fits it
+	// a wake flow is written only with its signal's slice, which has no
+	// length, so the two events of each flow count in the first bucket
+	size_t min_dur = 0, total = 0;
+	if (budget > 0) {
+		std::vector<size_t> cost;
+		slice_scanner S;
+		slice s;
+		scan_global([&] (const event_store& E, size_t i) {
+			if (!S.add(E.ev[i], E.thrd[i], E.obj[i], E.caller[i], E.ts[i], s)) return;
+			size_t b = dur_bucket(to_ns(s.end) - to_ns(s.begin));
+			if (b >= cost.size()) cost.resize(b + 1, 0);
+			++cost[b];
+			++total;
+			if (s.sig_thrd == UINT32_MAX) return;
+			cost[0] += 2;
+			total += 2;
+		});
+		size_t b = cost.size(), kept = 0;
+		while (b > 0 && kept + cost[b-1] <= budget) kept += cost[--b];
+		if (b > 0) min_dur = dur_bucket_min(b);
+	}
+
+	json_out J (outs);
+	J << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	auto pid = [this] (size_t t) {
+		return (thrd_pids.empty()) ? hdr.pid : thrd_pids[t];
+	};
+	// threads are numbered by dense index, since pthread ids do not fit
+	// every viewer's integers, and named by their pthread id and hook
+	for (size_t t = 0; t < thrds.size(); ++t) {
+		if (t == 0 || pid(t) != pid(t-1)) {
+			J << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":" << pid(t)
+				<< ",\"args\":{\"name\":";
+			J.str("process " + std::to_string(pid(t))) << "}},\n";
+		}
+		J << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid(t) << ",\"tid\":"
+			<< t + 1 << ",\"args\":{\"name\":";
+		std::ostringstream name;
+		name << "0x" << std::hex << thrds[t].tid << " (" << thrd_hooks[t] << ')';
+		J.str(name.str()) << "}},\n";
+	}
+
+	const char* names[] = {"wait ", "hold ", "cond wait ", "signal "};
+	const char* cats[] = {"lock", "lock", "cond", "cond"};
+	size_t written = 0, flows = 0;
+	slice_scanner S;
+	slice s;
+	bool first = true;
+	std::vector<lanes> L (thrds.size());
+	size_t next_tid = thrds.size() + 1; // of the threads' extra tracks
+	// the track of the last signal written of each condvar (thread, time
+	// and tid), for its flows, key=object id
+	std::unordered_map<uint32_t, std::tuple<uint32_t, size_t, size_t> > sig_tid;
+	scan_global([&] (const event_store& E, size_t i) {
+		if (!S.add(E.ev[i], E.thrd[i], E.obj[i], E.caller[i], E.ts[i], s)) return;
+		size_t begin = to_ns(s.begin), end = to_ns(s.end);
+		if (end - begin < min_dur) return;
+		++written;
+		if (!first) J << ",\n";
+		first = false;
+		lanes& T = L[s.thrd];
+		size_t l = T.place(begin, end);
+		if (l == SIZE_MAX) {
+			// a new track, named after the thread
+			l = T.top.size() - 1;
+			T.tids.push_back((l == 0) ? s.thrd + 1 : next_tid++);
+			if (l > 0) {
+				J << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid(s.thrd)
+					<< ",\"tid\":" << T.tids[l] << ",\"args\":{\"name\":";
+				std::ostringstream name;
+				name << "0x" << std::hex << thrds[s.thrd].tid << " (" << thrd_hooks[s.thrd]
+					<< ") #" << std::dec << l + 1;
+				J.str(name.str()) << "}},\n";
+			}
+		}
+		size_t tid = T.tids[l];
+		if (S.idle(s.thrd)) T.clear();
+		if (s.kind == slice::COND_SIGNAL) sig_tid[s.obj] = {s.thrd, s.begin, tid};
+		J << "{\"ph\":\"X\",\"cat\":\"" << cats[s.kind] << "\",\"name\":\"" << names[s.kind];
+		J.hex(objs[s.obj]) << "\",\"pid\":" << pid(s.thrd) << ",\"tid\":" << tid
+			<< ",\"ts\":";
+		J.usec(begin) << ",\"dur\":";
+		J.usec(end - begin) << ",\"args\":{\"caller\":";
+		J.str(caller_names[s.caller]) << "}}";
+		if (s.sig_thrd == UINT32_MAX) return;
+		// flow from the signal's track to the end of the wait, if the signal
+		// was written
+		auto it = sig_tid.find(s.obj);
+		if (it == sig_tid.end() || std::get<0>(it->second) != s.sig_thrd
+				|| std::get<1>(it->second) != s.sig_ts)
+			return;
+		++flows;
+		written += 2;
+		J << ",\n{\"ph\":\"s\",\"cat\":\"cond\",\"name\":\"wake\",\"id\":" << flows
+			<< ",\"pid\":" << pid(s.sig_thrd) << ",\"tid\":" << std::get<2>(it->second)
+			<< ",\"ts\":";
+		J.usec(to_ns(s.sig_ts)) << "},\n";
+		J << "{\"ph\":\"f\",\"bp\":\"e\",\"cat\":\"cond\",\"name\":\"wake\",\"id\":" << flows
+			<< ",\"pid\":" << pid(s.thrd) << ",\"tid\":" << tid << ",\"ts\":";
+		J.usec(end) << "}";
+	});
+
+	J << "\n],\"otherData\":{\"events\":" << written << ",\"dropped\":"
+		<< total - std::min(total, written) << ",\"min_slice_ns\":" << min_dur << "}}\n";
+}
+
+} // namespace lktrace
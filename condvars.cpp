@@ -0,0 +1,74 @@
+// condvar wakeup analysis: how long woken threads take to run after a signal
+// or broadcast, waits left with no signal (spurious wakes), signals lost with
+// no thread waiting, and the thundering herd of a broadcast, whose threads
+// block on the mutex in turn or find nothing to do and wait again
+// (see cond_scanner)
+#include "parser.h"
+
+#include <algorithm> // sort()
+
+namespace lktrace {
+
+// compute cond_stats for every waited or signaled condvar
+void parser::find_condvars () {
+	cond_scanner C (thrds.size(), (window > 0) ? STREAM_SAMPLES : SIZE_MAX);
+	scan_global([&] (const event_store& E, size_t i) {
+		C.add(E.ev[i], E.thrd[i], E.obj[i], E.ts[i]);
+	});
+
+	cv_stats.clear();
+	for (auto& [obj, c] : C.conds) {
+		cond_stats S;
+		S.obj = obj;
+		S.mutex = c.mutex;
+		S.waits = c.waits;
+		S.signals = c.signals;
+		S.brdcsts = c.brdcsts;
+		S.by_signal = c.by_signal;
+		S.by_brdcst = c.by_brdcst;
+		S.spurious = c.spurious;
+		S.failed = c.failed;
+		S.lost_signals = c.lost_signals;
+		S.lost_brdcsts = c.lost_brdcsts;
+		S.wake_total = c.wake_total;
+		c.wake.percentiles(S.wake_pct);
+		S.blocked = c.blocked;
+		S.rewaits = c.rewaits;
+		S.herd_blocked = c.herd_blocked;
+		S.herd_rewaits = c.herd_rewaits;
+		cv_stats.push_back(S);
+	}
+	std::sort(cv_stats.begin(), cv_stats.end(), [] (const cond_stats& a, const cond_stats& b) {
+		if (a.wake_total != b.wake_total) return a.wake_total > b.wake_total;
+		if (a.waits != b.waits) return a.waits > b.waits;
+		return a.obj < b.obj;
+	});
+}
+
+void parser::dump_condvars (std::ostream& outs) {
+	for (const cond_stats& S : cv_stats) {
+		outs << "Condvar 0x" << std::hex << objs[S.obj];
+		if (S.mutex != UINT32_MAX) outs << " (mutex 0x" << objs[S.mutex] << ')';
+		put_obj_pid(outs, S.obj);
+		outs << ": " << S.waits << " waits, " << S.signals << " signals, "
+			<< S.brdcsts << " broadcasts\n";
+		outs << "\twoken: " << S.by_signal << " by signal, " << S.by_brdcst
+			<< " by broadcast, " << S.spurious << " spurious, " << S.failed
+			<< " timed out or failed\n";
+		outs << "\tlost (no waiter): " << S.lost_signals << " signals, " << S.lost_brdcsts
+			<< " broadcasts\n";
+		outs << "\tsignal to wake: total " << to_ns(S.wake_total) << ", p50 "
+			<< to_ns(S.wake_pct[0]) << ", p90 " << to_ns(S.wake_pct[1]) << ", p99 "
+			<< to_ns(S.wake_pct[2]) << ", max " << to_ns(S.wake_pct[3]) << " ns\n";
+		outs << "\tmutex held by another thread between signal and wake: " << S.blocked
+			<< " wake(s)\n";
+		outs << "\twaited again before releasing the mutex: " << S.rewaits << " wake(s)\n";
+		if (S.by_brdcst > 0)
+			outs << "\tthundering herd: " << S.by_brdcst << " threads woken by "
+				<< S.brdcsts - S.lost_brdcsts << " broadcasts, " << S.herd_blocked
+				<< " blocked on the mutex, " << S.herd_rewaits << " waited again\n";
+		outs << '\n';
+	}
+}
+
+} // namespace lktrace
@@ -0,0 +1,97 @@
+// lock convoys and handoff fairness, from each lock's owner sequence (see
+// convoy_scanner): the time a lock spends handed round-robin between the
+// same threads with every acquire contended, who gets the lock when it is
+// released with threads waiting, and which threads wait longest
+#include "parser.h"
+
+#include <memory> // unique_ptr
+#include <algorithm> // sort()
+
+// threads shown per lock
+#define TOP_STARVED 3
+
+namespace lktrace {
+
+namespace {
+
+// fill S with the results of a finished convoy scanner
+void convoy_result (convoy_scanner& C, convoy_stats& S) {
+	C.end_run();
+	S.span = (C.first_ts == SIZE_MAX) ? 0 : C.last_ts - C.first_ts;
+	S.convoys = C.convoys;
+	S.convoy_time = C.convoy_time;
+	S.longest = C.longest;
+	S.longest_acqs = C.longest_acqs;
+	S.longest_thrds = C.longest_thrds;
+	S.handoffs = C.handoffs;
+	S.in_order = C.in_order;
+	S.out_of_order = C.out_of_order;
+	S.barged = C.barged;
+	S.barged_self = C.barged_self;
+	S.to_cond = C.to_cond;
+	S.starved.clear();
+	for (auto& [t, w] : C.thrds)
+		S.starved.emplace_back(t, w.waits, w.max_wait, w.max_overtaken);
+	std::sort(S.starved.begin(), S.starved.end(), [] (auto& a, auto& b) {
+		return std::get<2>(a) > std::get<2>(b) ||
+			(std::get<2>(a) == std::get<2>(b) && std::get<0>(a) < std::get<0>(b));
+	});
+	if (S.starved.size() > TOP_STARVED) S.starved.resize(TOP_STARVED);
+}
+
+} // namespace
+
+// compute convoy_stats for every lock handed off with threads waiting
+// an acquisition is contended if it waited more than threshold ticks
+void parser::find_convoys (size_t threshold) {
+	lk_convoys.assign(objs.size(), convoy_stats());
+	// scanners are made for the objects with lock events only
+	std::vector<std::unique_ptr<convoy_scanner> > C (objs.size());
+	scan_locks([&] (uint32_t o, const event_store& E, size_t i) {
+		if (!C[o]) C[o].reset(new convoy_scanner());
+		C[o]->add(E.ev[i], E.thrd[i], E.ts[i], threshold);
+	});
+	for (size_t o = 0; o < objs.size(); ++o) {
+		lk_convoys[o].obj = (uint32_t) o;
+		if (C[o]) convoy_result(*C[o], lk_convoys[o]);
+	}
+
+	lk_convoys.erase(std::remove_if(lk_convoys.begin(), lk_convoys.end(),
+		[] (const convoy_stats& S) {
+			return S.handoffs == 0 && S.to_cond == 0 && S.convoys == 0;
+		}),
+		lk_convoys.end());
+	std::sort(lk_convoys.begin(), lk_convoys.end(),
+		[] (const convoy_stats& a, const convoy_stats& b) {
+			if (a.convoy_time != b.convoy_time) return a.convoy_time > b.convoy_time;
+			if (a.handoffs != b.handoffs) return a.handoffs > b.handoffs;
+			return a.obj < b.obj;
+	});
+}
+
+void parser::dump_convoys (std::ostream& outs) {
+	for (const convoy_stats& S : lk_convoys) {
+		outs << "Lock 0x" << std::hex << objs[S.obj];
+		put_obj_pid(outs, S.obj);
+		outs << ": " << S.convoys
+			<< " convoys, " << to_ns(S.convoy_time) << " ns in convoy";
+		if (S.span > 0) outs << " (" << S.convoy_time * 100 / S.span << "% of its use)";
+		outs << '\n';
+		if (S.convoys > 0)
+			outs << "\tlongest: " << to_ns(S.longest) << " ns, " << S.longest_acqs
+				<< " acquisitions round-robin between " << S.longest_thrds << " threads\n";
+		outs << "\thandoffs with threads waiting: " << S.handoffs << ", " << S.in_order
+			<< " to the longest waiter, " << S.out_of_order << " to another waiter, "
+			<< S.barged << " barged (" << S.barged_self << " by the releaser)\n";
+		if (S.to_cond > 0)
+			outs << "\tto a thread leaving a condvar wait (not counted above): " << S.to_cond
+				<< '\n';
+		for (auto& [t, waits, max_wait, overtaken] : S.starved)
+			outs << "\tthread 0x" << std::hex << thrds[t].tid << std::dec << ": waited up to "
+				<< to_ns(max_wait) << " ns in " << waits << " wait(s), overtaken up to "
+				<< overtaken << " time(s)\n";
+		outs << '\n';
+	}
+}
+
+} // namespace lktrace
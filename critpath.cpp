@@ -0,0 +1,259 @@
+// critical path of one thread over a time window: starting at the end of the
+// window and going back in time, the path follows the thread while it runs;
+// while it waits for a lock, the path moves to the thread whose release let
+// it go on (or, if there was none yet, the thread holding the lock), and
+// while it waits on a condvar, to the thread whose signal woke it, and goes
+// on from there
+// so the window splits into the traced thread's own execution and the time
+// it was held up by each wait along the chain, directly or transitively
+#include "parser.h"
+
+#include <map>
+#include <algorithm> // upper_bound(), sort()
+
+// path steps listed
+#define PATH_STEPS 100
+
+namespace lktrace {
+
+namespace {
+
+// a wait of a thread, over (begin, end]
+struct blocked {
+	size_t begin;
+	size_t end;
+	uint32_t obj;
+	uint32_t caller;
+	bool cond;
+};
+
+// times (and threads) of a sync object's acquires, releases or signals
+typedef std::vector<std::pair<size_t, uint32_t> > obj_events;
+
+// last of E at or after lo and at or before hi by a thread other than x
+const std::pair<size_t, uint32_t>* last_other (const obj_events& E, size_t lo, size_t hi,
+		uint32_t x) {
+	auto it = std::upper_bound(E.begin(), E.end(), std::make_pair(hi, UINT32_MAX));
+	while (it != E.begin()) {
+		--it;
+		if (it->first < lo) break;
+		if (it->second != x) return &*it;
+	}
+	return nullptr;
+}
+
+} // namespace
+
+// find the critical path of the one thread in q over its time range, clipped
+// to the thread's lifetime
+void parser::find_critical_path (const query& q) {
+	path = crit_path();
+	auto it = thrd_ind.find(q.tids.front());
+	if (it == thrd_ind.end()) return;
+	if (it->second == UINT32_MAX) { // in several processes (see multi.cpp)
+		path.ambiguous = true;
+		return;
+	}
+	path.thrd = it->second;
+	query w = q;
+	w.to_ticks(hdr);
+	size_t lo = w.t_lo, hi = w.t_hi;
+
+	// the waits of every thread, and the lock and condvar events they can
+	// be followed through, within the window
+	std::vector<std::vector<blocked> > waits (thrds.size());
+	std::vector<blocked> open (thrds.size(), {0, 0, UINT32_MAX, UINT32_MAX, false});
+	std::vector<obj_events> acqs (objs.size()), rels (objs.size()), sigs (objs.size());
+	std::vector<size_t> born (thrds.size(), SIZE_MAX); // first event of each thread
+	size_t last = 0; // of the traced thread
+	scan_global([&] (const event_store& E, size_t i) {
+		size_t ts = E.ts[i];
+		uint32_t t = E.thrd[i], obj = E.obj[i];
+		born[t] = std::min(born[t], ts);
+		if (t == path.thrd) last = ts;
+		if (ts > hi) return;
+		blocked& B = open[t];
+		switch (E.ev[i]) {
+		case (event::LOCK_REQ):
+			B = {ts, 0, obj, E.caller[i], false};
+			break;
+		case (event::LOCK_ERR): // failed trylock
+			B.begin = 0;
+			B.caller = UINT32_MAX;
+			break;
+		case (event::LOCK_ACQ):
+			if (B.caller != UINT32_MAX) {
+				B.end = ts;
+				B.obj = obj;
+				if (ts >= lo) waits[t].push_back(B);
+				B.caller = UINT32_MAX;
+			}
+			// only the holder at the start of the window is kept from before it
+			if (ts < lo) acqs[obj].clear();
+			acqs[obj].emplace_back(ts, t);
+			break;
+		case (event::LOCK_REL):
+			if (ts >= lo) rels[obj].emplace_back(ts, t);
+			break;
+		case (event::COND_WAIT):
+			B = {ts, 0, obj, E.caller[i], true};
+			break;
+		case (event::COND_LEAVE):
+		case (event::COND_ERR):
+			if (B.caller != UINT32_MAX && B.cond) {
+				B.end = ts;
+				if (ts >= lo) waits[t].push_back(B);
+			}
+			// then the mutex is reacquired
+			B = {ts, 0, UINT32_MAX, E.caller[i], false};
+			break;
+		case (event::COND_SIGNAL):
+		case (event::COND_BRDCST):
+			if (ts >= lo) sigs[obj].emplace_back(ts, t);
+			break;
+		default:
+			break;
+		}
+	});
+	if (born[path.thrd] == SIZE_MAX) return;
+	lo = std::max(lo, born[path.thrd]);
+	hi = std::min(hi, last);
+	if (lo >= hi) return;
+	path.begin = lo;
+	path.end = hi;
+	// waits still open at the end of the window
+	for (size_t t = 0; t < thrds.size(); ++t) {
+		blocked& B = open[t];
+		if (B.caller == UINT32_MAX || B.obj == UINT32_MAX) continue;
+		B.end = SIZE_MAX;
+		waits[t].push_back(B);
+	}
+
+	auto step = [this, lo] (path_seg::kind_t kind, uint32_t t, uint32_t obj,
+			uint32_t caller, size_t begin, size_t end) {
+		begin = std::max(begin, lo);
+		if (begin >= end) return;
+		if (!path.segs.empty()) { // extends the previous step
+			path_seg& s = path.segs.back();
+			if (s.kind == kind && s.thrd == t && s.obj == obj && s.caller == caller
+					&& s.begin == end) {
+				s.begin = begin;
+				return;
+			}
+		}
+		path.segs.push_back({kind, t, obj, caller, begin, end});
+	};
+
+	uint32_t x = path.thrd;
+	size_t t = hi;
+	// wait the path reached x by
+	uint32_t via_obj = UINT32_MAX, via_caller = UINT32_MAX;
+	// moves to another thread without going back in time, to stop cycles
+	// between waits that end at the same tick
+	size_t still = 0;
+	while (t > lo) {
+		const std::vector<blocked>& W = waits[x];
+		auto b = std::lower_bound(W.begin(), W.end(), t,
+			[] (const blocked& B, size_t v) {return B.end < v;});
+		if (b == W.end() || b->begin >= t) { // running
+			size_t from = (b == W.begin()) ? born[x] : std::prev(b)->end;
+			if (x == path.thrd) step(path_seg::RUN, x, UINT32_MAX, UINT32_MAX, from, t);
+			else step(path_seg::RUN, x, via_obj, via_caller, from, t);
+			// nothing is known of a thread before it started
+			if (from == born[x] && x != path.thrd) break;
+			t = from;
+			still = 0;
+			continue;
+		}
+		// waiting since b->begin: for the thread that released the lock or
+		// signaled the condvar since, or else the lock's holder
+		path_seg::kind_t kind = (b->cond) ? path_seg::COND_WAIT : path_seg::LOCK_WAIT;
+		const std::pair<size_t, uint32_t>* by =
+			last_other((b->cond) ? sigs[b->obj] : rels[b->obj], b->begin, t, x);
+		if (!by && !b->cond) by = last_other(acqs[b->obj], 0, t, x);
+		size_t at = (by) ? std::max(by->first, b->begin) : b->begin;
+		if (by && at == t && ++still > thrds.size()) by = nullptr;
+		if (!by) { // nothing to follow (eg. a timed out wait)
+			step(kind, x, b->obj, b->caller, b->begin, t);
+			t = b->begin;
+			continue;
+		}
+		if (at < t) still = 0;
+		step(kind, x, b->obj, b->caller, at, t);
+		via_obj = b->obj;
+		via_caller = b->caller;
+		x = by->second;
+		t = at;
+	}
+}
+
+// the traced thread's time by own execution and by the wait it was held up
+// by, most first, then the path
+void parser::dump_critical_path (std::ostream& outs) {
+	if (path.ambiguous) {
+		outs << "Critical path: thread id in several processes, analyze its trace without"
+			" --tree.\n\n";
+		return;
+	}
+	if (path.thrd == UINT32_MAX) {
+		outs << "Critical path: thread not in trace.\n\n";
+		return;
+	}
+	size_t total = to_ns(path.end) - to_ns(path.begin);
+	outs << "Critical path of thread 0x" << std::hex << thrds[path.thrd].tid << " ("
+		<< thrd_hooks[path.thrd] << ") from " << std::dec << to_ns(path.begin) << " to "
+		<< to_ns(path.end) << " ns (" << total << " ns):\n";
+	if (total == 0) {
+		outs << '\n';
+		return;
+	}
+
+	// key=object id, caller id (UINT32_MAX for own execution), value=ns
+	// waiting directly and running in other threads
+	std::map<std::pair<uint32_t, uint32_t>, std::pair<size_t, size_t> > by_wait;
+	std::map<std::pair<uint32_t, uint32_t>, bool> cond;
+	for (const path_seg& s : path.segs) {
+		size_t ns = to_ns(s.end) - to_ns(s.begin);
+		auto& w = by_wait[{s.obj, s.caller}];
+		((s.kind == path_seg::RUN) ? w.second : w.first) += ns;
+		if (s.kind == path_seg::COND_WAIT) cond[{s.obj, s.caller}] = true;
+	}
+	size_t shown = 0;
+	std::vector<std::pair<std::pair<uint32_t, uint32_t>, std::pair<size_t, size_t> > > ranked (
+		by_wait.begin(), by_wait.end());
+	std::stable_sort(ranked.begin(), ranked.end(), [] (auto& a, auto& b) {
+		return a.second.first + a.second.second > b.second.first + b.second.second;
+	});
+	for (auto& [key, ns] : ranked) {
+		size_t sum = ns.first + ns.second;
+		shown += sum;
+		if (key.first == UINT32_MAX) {
+			outs << "\town execution: " << sum << " ns (" << sum * 100 / total << "%)\n";
+			continue;
+		}
+		outs << '\t' << ((cond.count(key)) ? "condvar" : "lock") << " 0x" << std::hex
+			<< objs[key.first] << " @" << caller_names[key.second] << " [0x"
+			<< callers[key.second] << "]: " << std::dec << sum << " ns ("
+			<< sum * 100 / total << "%), " << ns.first << " waiting, " << ns.second
+			<< " in other threads\n";
+	}
+
+	if (shown < total)
+		outs << "\tbefore the path's earliest thread started: " << total - shown << " ns\n";
+	outs << "\tpath, latest first:\n";
+	const char* what[] = {"running", "waiting for lock", "waiting on condvar"};
+	size_t n = std::min<size_t>(path.segs.size(), PATH_STEPS);
+	for (size_t k = 0; k < n; ++k) {
+		const path_seg& s = path.segs[k];
+		outs << "\t\t" << std::dec << to_ns(s.begin) << '-' << to_ns(s.end) << " ns: thread 0x"
+			<< std::hex << thrds[s.thrd].tid << ' ' << what[s.kind];
+		if (s.kind != path_seg::RUN)
+			outs << " 0x" << objs[s.obj] << " @" << caller_names[s.caller];
+		outs << '\n';
+	}
+	if (path.segs.size() > n)
+		outs << "\t\t(" << std::dec << path.segs.size() - n << " earlier steps)\n";
+	outs << std::dec << '\n';
+}
+
+} // namespace lktrace
@@ -3,6 +3,7 @@
 #include <execinfo.h>
 #include <cassert>
 #include <string>
+#include <string_view>
 #include <cctype>
 
 namespace lktrace {
@@ -17,9 +18,10 @@ enum class event : uint16_t {
 	COND_WAIT = 0xEFFF, COND_LEAVE = 0xEFFE, COND_SIGNAL = 0xEFFD,
 	COND_BRDCST = 0xEFFC, COND_ERR = 0xEFFB, COND_EVENT_TYPE = 0xE000,
        	THRD_SPAWN = 0xDFF6, THRD_EXIT = 0xDFF5, THRD_EVENT_TYPE = 0xD000,
+	SECT_RPT = 0xCFFF, META_EVENT_TYPE = 0xC000,
 	NULL_EVENT = 0x0};
 
-inline event ev_str_to_code(std::string str) {
+inline event ev_str_to_code(std::string_view str) {
 	event ev;
 	switch (str[0]) {
 	case ('T'):
@@ -38,6 +40,12 @@ inline event ev_str_to_code(std::string str) {
 			default: assert(false); break;
 		}
 		break;
+	case ('R'):
+		switch(str[1]) {
+			case ('S'): ev = event::SECT_RPT; break;
+			default: assert(false); break;
+		}
+		break;
 	case ('C'):
 		switch(str[1]) {
 			case ('W'): ev = event::COND_WAIT; break;
@@ -70,6 +78,8 @@ inline std::string ev_to_descr(event ev, bool lower = false) {
 	case (event::COND_SIGNAL): str = "Signaled condvar"; break;
 	case (event::COND_BRDCST): str = "Broadcasted condvar"; break;
 	case (event::COND_ERR): str = "Error waiting on condvar"; break;
+	case (event::SECT_RPT): str = "Repeated critical section"; break;
+	default: assert(false && "Unrecognized event!"); break;
 	}
 
 	if (lower) str[0] = std::tolower(str[0]);	
@@ -102,6 +112,8 @@ inline std::string ev_code_to_str (event ev) {
 			return "TS";
 		case (event::THRD_EXIT):
 			return "TE";
+		case (event::SECT_RPT):
+			return "RS";
 		default:
 			assert(false && "Unrecognized event!");
 	}
@@ -0,0 +1,59 @@
+// lock wait or hold time as a flame graph, in the folded stack format of
+// flamegraph.pl ("frame;frame;frame weight"): thread hook, then callsite
+// (or its whole stack, outermost frame first, if the trace has stacks),
+// then lock, weighted by ns (see flame_scanner)
+// threads are scanned in one pass each, in parallel, and their totals are
+// then merged by hook, so threads running the same function fold together
+#include "parser.h"
+#include "parallel.h"
+
+#include <map>
+
+namespace lktrace {
+
+void parser::find_flame (bool hold) {
+	std::vector<flame_scanner> F (thrds.size(), flame_scanner(hold));
+	const std::vector<uint32_t>& site = (store.with_ctx) ? store.ctx : store.caller;
+	parallel_for(thrds.size(), [&] (size_t t) {
+		for (size_t i = thrds[t].begin; i < thrds[t].end; ++i)
+			F[t].add(store.ev[i], store.obj[i], site[i], store.ts[i]);
+	});
+	merge_flame(F);
+}
+
+// merge the per-thread totals into flame, by process, hook, callsite and lock
+void parser::merge_flame (std::vector<flame_scanner>& F) {
+	std::map<std::tuple<uint64_t, std::string_view, uint32_t, uint32_t>, size_t> stacks;
+	for (size_t t = 0; t < F.size(); ++t) {
+		uint64_t pid = (thrd_pids.empty()) ? 0 : thrd_pids[t];
+		for (auto& w : F[t].ticks) {
+			if (w.second == 0) continue;
+			stacks[{pid, thrd_hooks[t], (uint32_t) (w.first >> 32), (uint32_t) w.first}]
+				+= w.second;
+		}
+		F[t] = flame_scanner(F[t].hold);
+	}
+	flame.clear();
+	for (auto& s : stacks)
+		flame.emplace_back(std::get<0>(s.first), std::get<1>(s.first),
+			std::get<2>(s.first), std::get<3>(s.first), s.second);
+}
+
+// one line per stack; merged traces start with the process
+void parser::dump_flame (std::ostream& outs) {
+	std::vector<uint32_t> frames;
+	for (auto& [pid, hook, site, obj, ticks] : flame) {
+		if (!thrd_pids.empty()) outs << "process " << std::dec << pid << ';';
+		outs << hook;
+		if (cct.empty()) frames.assign(1, site);
+		else ctx_frames(site, frames);
+		for (size_t f = frames.size(); f-- > 0;) {
+			uint32_t caller = frames[f];
+			if (caller_names[caller].empty()) outs << ";0x" << std::hex << callers[caller];
+			else outs << ';' << caller_names[caller];
+		}
+		outs << ";0x" << std::hex << objs[obj] << ' ' << std::dec << to_ns(ticks) << '\n';
+	}
+}
+
+} // namespace lktrace
@@ -2,24 +2,69 @@
 #include <iostream>
 #include <fstream>
 #include <getopt.h>
+#include <dirent.h> // opendir()
+#include <sys/stat.h> // stat()
+#include <algorithm> // sort()
+#include <cstring> // strcmp()
 #include <cassert>
 #include "enum_ops.h"
 int main (int argc, char** argv) {
 	// initialize params
 	std::string out_fname;
 	size_t min_depth = 0;
-	enum CMD : char {CMD_NONE =0x0, CMD_THREADS = 0x1, CMD_PATTERNS = 0x2,
-		CMD_PATTERNS_TXT = 0x4, CMD_GLOBAL = 0x8};
+	size_t threshold = 1000; // contention threshold for --locks, --convoys and --false-sharing (ticks)
+	size_t budget = 2000000; // events written by --export-chrome (0 = all)
+	bool flame_hold = false; // --flamegraph weight: hold rather than wait time
+	bool queue_csv = false; // --queue-depth as a timeline rather than a summary
+	bool util_csv = false; // --utilization as a timeline rather than a summary
+	size_t buckets = 100; // timeline buckets of --queue-depth=csv and --utilization=csv
+	bool stream = false;
+	size_t window = 65536; // events buffered per thread when streaming
+	bool cache = true; // load from and save to the trace's sidecar cache
+	bool tree = false; // merge multiple traces into one
+	bool shared = false; // --tree: identify sync objects by address across processes
+	lktrace::query where; // events to analyze (all by default)
+	lktrace::query path_of; // thread and time window of --critical-path
+	enum CMD : unsigned {CMD_NONE =0x0, CMD_THREADS = 0x1, CMD_PATTERNS = 0x2,
+		CMD_PATTERNS_TXT = 0x4, CMD_GLOBAL = 0x8, CMD_LOCKS = 0x10,
+		CMD_CHROME = 0x20, CMD_FLAME = 0x40, CMD_BLAME = 0x80,
+		CMD_CRITPATH = 0x100, CMD_CONDVARS = 0x200, CMD_CONVOYS = 0x400,
+		CMD_MIGRATION = 0x800, CMD_SHARING = 0x1000,
+		CMD_QUEUE = 0x2000, CMD_UTIL = 0x4000};
 	CMD the_command = CMD_NONE;
 
 	// setup options
 	enum OPT_ID : int {OPT_OUTFILE = (int) 'o', OPT_DEPTH = (int) 'd',
-		OPT_THREADS, OPT_PATTERNS, OPT_PATTERNS_TXT, OPT_GLOBAL};
+		OPT_THREADS = 0x100, OPT_PATTERNS, OPT_PATTERNS_TXT, OPT_GLOBAL, OPT_LOCKS,
+		OPT_THRESHOLD, OPT_STREAM, OPT_WINDOW, OPT_NO_CACHE, OPT_TREE, OPT_WHERE,
+		OPT_CHROME, OPT_BUDGET, OPT_FLAME, OPT_BLAME,
+		OPT_CRITPATH, OPT_CONDVARS, OPT_CONVOYS, OPT_MIGRATION,
+		OPT_SHARING, OPT_QUEUE, OPT_BUCKETS, OPT_UTIL, OPT_SHARED};
 	const option longopts[] = {
 		{"threads", no_argument, nullptr, OPT_THREADS},
 		{"patterns", no_argument, nullptr, OPT_PATTERNS},
 		{"patterns-text", no_argument, nullptr, OPT_PATTERNS_TXT},
 		{"global", no_argument, nullptr, OPT_GLOBAL},
+		{"locks", no_argument, nullptr, OPT_LOCKS},
+		{"threshold", required_argument, nullptr, OPT_THRESHOLD},
+		{"stream", no_argument, nullptr, OPT_STREAM},
+		{"window", required_argument, nullptr, OPT_WINDOW},
+		{"no-cache", no_argument, nullptr, OPT_NO_CACHE},
+		{"tree", no_argument, nullptr, OPT_TREE},
+		{"shared-locks", no_argument, nullptr, OPT_SHARED},
+		{"where", required_argument, nullptr, OPT_WHERE},
+		{"export-chrome", no_argument, nullptr, OPT_CHROME},
+		{"chrome-budget", required_argument, nullptr, OPT_BUDGET},
+		{"flamegraph", required_argument, nullptr, OPT_FLAME},
+		{"blame", no_argument, nullptr, OPT_BLAME},
+		{"critical-path", required_argument, nullptr, OPT_CRITPATH},
+		{"condvars", no_argument, nullptr, OPT_CONDVARS},
+		{"convoys", no_argument, nullptr, OPT_CONVOYS},
+		{"migration", no_argument, nullptr, OPT_MIGRATION},
+		{"false-sharing", no_argument, nullptr, OPT_SHARING},
+		{"queue-depth", required_argument, nullptr, OPT_QUEUE},
+		{"buckets", required_argument, nullptr, OPT_BUCKETS},
+		{"utilization", required_argument, nullptr, OPT_UTIL},
 		{0, 0, 0, 0}};
 	int opt;
 
@@ -44,6 +89,99 @@ int main (int argc, char** argv) {
 		case (OPT_GLOBAL):
 			the_command |= CMD_GLOBAL;
 			break;
+		case (OPT_LOCKS):
+			the_command |= CMD_LOCKS;
+			break;
+		case (OPT_THRESHOLD):
+			threshold = strtoull(optarg, nullptr, 10);
+			break;
+		case (OPT_STREAM):
+			stream = true;
+			break;
+		case (OPT_WINDOW):
+			window = strtoull(optarg, nullptr, 10);
+			break;
+		case (OPT_NO_CACHE):
+			cache = false;
+			break;
+		case (OPT_TREE):
+			tree = true;
+			break;
+		case (OPT_SHARED):
+			shared = true;
+			break;
+		case (OPT_CHROME):
+			the_command |= CMD_CHROME;
+			break;
+		case (OPT_BUDGET):
+			budget = strtoull(optarg, nullptr, 10);
+			break;
+		case (OPT_FLAME):
+			the_command |= CMD_FLAME;
+			if (strcmp(optarg, "wait") == 0) flame_hold = false;
+			else if (strcmp(optarg, "hold") == 0) flame_hold = true;
+			else {
+				std::cerr << "Flame graph weight must be wait or hold.\n";
+				return 1;
+			}
+			break;
+		case (OPT_BLAME):
+			the_command |= CMD_BLAME;
+			break;
+		case (OPT_CONDVARS):
+			the_command |= CMD_CONDVARS;
+			break;
+		case (OPT_CONVOYS):
+			the_command |= CMD_CONVOYS;
+			break;
+		case (OPT_MIGRATION):
+			the_command |= CMD_MIGRATION;
+			break;
+		case (OPT_SHARING):
+			the_command |= CMD_SHARING;
+			break;
+		case (OPT_QUEUE):
+			the_command |= CMD_QUEUE;
+			if (strcmp(optarg, "text") == 0) queue_csv = false;
+			else if (strcmp(optarg, "csv") == 0) queue_csv = true;
+			else {
+				std::cerr << "Queue depth format must be text or csv.\n";
+				return 1;
+			}
+			break;
+		case (OPT_BUCKETS):
+			buckets = strtoull(optarg, nullptr, 10);
+			break;
+		case (OPT_UTIL):
+			the_command |= CMD_UTIL;
+			if (strcmp(optarg, "text") == 0) util_csv = false;
+			else if (strcmp(optarg, "csv") == 0) util_csv = true;
+			else {
+				std::cerr << "Utilization format must be text or csv.\n";
+				return 1;
+			}
+			break;
+		case (OPT_CRITPATH): {
+			the_command |= CMD_CRITPATH;
+			std::string err;
+			if (!path_of.parse(optarg, err)) {
+				std::cerr << "Malformed critical path query: " << err << ".\n";
+				return 1;
+			}
+			if (path_of.tids.size() != 1) {
+				std::cerr << "Critical path query must name one thread.\n";
+				return 1;
+			}
+			break;
+		}
+		case (OPT_WHERE): {
+			std::string err;
+			if (!where.parse(optarg, err)) {
+				std::cerr << "Malformed query: " << err << ".\n";
+				return 1;
+			}
+			break;
+		}
 		default:
 			assert(false && "Default block in option parsing reached!");
 		}
@@ -67,28 +205,145 @@ int main (int argc, char** argv) {
 	if (optind == argc) {
 		std::cerr << "Must specify a trace file to parse.\n";
 		return 1;
-	} else if (argc - optind > 1) {
-		std::cerr << "Only one trace file at a time.\n";
-		return 1;
 	}
-
-	// run commands
-	lktrace::parser P (std::string(argv[optind]));
-	if (the_command & CMD_THREADS) {
-		P.dump_threads(outs);
+	// traces, with directories expanded to the traces in them
+	std::vector<std::string> fnames;
+	auto ends_with = [] (const std::string& s, const std::string& end) {
+		return s.size() >= end.size() && s.compare(s.size() - end.size(), end.size(), end) == 0;
+	};
+	for (int a = optind; a < argc; ++a) {
+		struct stat info;
+		if (stat(argv[a], &info) != 0) {
+			std::cerr << "Could not open trace file " << argv[a] << ".\n";
+			return 1;
+		}
+		if (!S_ISDIR(info.st_mode)) {
+			fnames.push_back(argv[a]);
+			continue;
+		}
+		DIR* dir = opendir(argv[a]);
+		if (!dir) {
+			std::cerr << "Could not open directory " << argv[a] << ".\n";
+			return 1;
+		}
+		std::vector<std::string> found;
+		while (dirent* d = readdir(dir)) {
+			std::string name = d->d_name;
+			// skip hidden files and caches (see parser.h)
+			if (name[0] == '.' || ends_with(name, CACHE_SUFFIX)
+					|| ends_with(name, CACHE_SUFFIX ".tmp"))
+				continue;
+			std::string path = std::string(argv[a]) + '/' + name;
+			if (stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+				found.push_back(path);
+		}
+		closedir(dir);
+		std::sort(found.begin(), found.end());
+		fnames.insert(fnames.end(), found.begin(), found.end());
 	}
-	if (the_command & CMD_PATTERNS_TXT) {
-		P.find_patterns();
-		P.dump_patterns_txt(outs, min_depth);
+	if (fnames.empty()) {
+		std::cerr << "No trace files found.\n";
+		return 1;
 	}
-	if (the_command & CMD_PATTERNS) {
-		P.find_deps(min_depth);
-		P.dump_patterns(outs);
+	if (buckets == 0) {
+		std::cerr << "Must have at least one bucket.\n";
+		return 1;
+	}
+	if (stream && window == 0) {
+		std::cerr << "Window must be at least one event.\n";
+		return 1;
 	}
-	if (the_command & CMD_GLOBAL) {
-		P.dump_global(outs);
+	if (stream && (fnames.size() > 1 || tree)) {
+		std::cerr << "Only one trace file at a time in streaming mode.\n";
+		return 1;
 	}
 
+	// run commands
+	// in streaming mode, the analyses run together in one pass up front
+	auto run = [&] (lktrace::parser& P) {
+		if (stream && (the_command & (CMD_PATTERNS_TXT | CMD_PATTERNS | CMD_LOCKS))) {
+			P.stream_find(the_command & CMD_PATTERNS, the_command & CMD_PATTERNS_TXT,
+				the_command & CMD_LOCKS, min_depth, threshold);
+		}
+		if (the_command & CMD_THREADS) {
+			if (stream) P.stream_threads(outs);
+			else P.dump_threads(outs);
+		}
+		if (the_command & CMD_PATTERNS_TXT) {
+			if (!stream) P.find_patterns();
+			P.dump_patterns_txt(outs, min_depth);
+		}
+		if (the_command & CMD_PATTERNS) {
+			if (!stream) P.find_deps(min_depth);
+			P.dump_patterns(outs);
+		}
+		if (the_command & CMD_GLOBAL) {
+			if (stream) P.stream_global(outs);
+			else P.dump_global(outs);
+		}
+		if (the_command & CMD_LOCKS) {
+			if (!stream) P.find_locks(threshold);
+			P.dump_locks(outs);
+		}
+		if (the_command & CMD_CHROME) P.export_chrome(outs, budget);
+		if (the_command & CMD_FLAME) {
+			if (stream) P.stream_flame(flame_hold);
+			else P.find_flame(flame_hold);
+			P.dump_flame(outs);
+		}
+		if (the_command & CMD_BLAME) {
+			P.find_blame();
+			P.dump_blame(outs);
+		}
+		if (the_command & CMD_CONDVARS) {
+			P.find_condvars();
+			P.dump_condvars(outs);
+		}
+		if (the_command & CMD_CONVOYS) {
+			P.find_convoys(threshold);
+			P.dump_convoys(outs);
+		}
+		if (the_command & CMD_MIGRATION) {
+			P.find_migration();
+			P.dump_migration(outs);
+		}
+		if (the_command & CMD_SHARING) {
+			P.find_false_sharing(threshold);
+			P.dump_false_sharing(outs);
+		}
+		if (the_command & CMD_QUEUE) {
+			P.find_queue_depth(buckets);
+			if (queue_csv) P.dump_queue_csv(outs);
+			else P.dump_queue_depth(outs);
+		}
+		if (the_command & CMD_UTIL) {
+			if (stream) P.stream_utilization(buckets);
+			else P.find_utilization(buckets);
+			if (util_csv) P.dump_utilization_csv(outs);
+			else P.dump_utilization(outs);
+		}
+		if (the_command & CMD_CRITPATH) {
+			P.find_critical_path(path_of);
+			P.dump_critical_path(outs);
+		}
+	};
+
+	if (fnames.size() == 1 && !tree) {
+		lktrace::parser P (fnames[0], (stream) ? window : 0, cache, where);
+		run(P);
+	} else {
+		// several processes: analyze each one, or the whole tree at once
+		auto procs = lktrace::parser::load_all(fnames, cache, where);
+		if (tree) {
+			lktrace::parser P (procs, shared);
+			run(P);
+		} else for (size_t k = 0; k < procs.size(); ++k) {
+			outs << "##### Process " << std::dec << procs[k]->pid() << " (" << fnames[k]
+				<< ")\n\n";
+			run(*procs[k]);
+			procs[k].reset();
+		}
+	}
 
 	if (file_out.is_open()) file_out.close();
 	return 0;	
@@ -14,12 +14,20 @@ int main (int argc, char** argv) {
 	// initialize params
 	std::string prefix = "lktracedat";
 	uint32_t trace_skip = 0;
+	uint32_t stack_depth = 0; // frames recorded per event (0 = caller only)
+	uint32_t flags = lktrace::CTL_NONE;
 	
 	// setup options
-	enum OPT_ID: int {OPT_PREFIX = (int) 'f', OPT_FSKIP = (int) 'd'};
+	enum OPT_ID: int {OPT_PREFIX = (int) 'f', OPT_FSKIP = (int) 'd', OPT_NO_RLE = 0x100,
+		OPT_TEXT, OPT_COMPRESS, OPT_STACK_DEPTH, OPT_CPU};
 	const option longopts[] = {
 		{"prefix", required_argument, nullptr, OPT_PREFIX},
 		{"skip-frames", required_argument, nullptr, OPT_FSKIP},
+		{"no-rle", no_argument, nullptr, OPT_NO_RLE},
+		{"text", no_argument, nullptr, OPT_TEXT},
+		{"compress", no_argument, nullptr, OPT_COMPRESS},
+		{"stack-depth", required_argument, nullptr, OPT_STACK_DEPTH},
+		{"cpu", no_argument, nullptr, OPT_CPU},
 		{0, 0, 0, 0}};
 	int opt;
 
@@ -32,6 +40,21 @@ int main (int argc, char** argv) {
 		case (OPT_FSKIP):
 			trace_skip = atoi(optarg);
 			break;
+		case (OPT_NO_RLE):
+			flags |= lktrace::CTL_NO_RLE;
+			break;
+		case (OPT_TEXT):
+			flags |= lktrace::CTL_TEXT;
+			break;
+		case (OPT_COMPRESS):
+			flags |= lktrace::CTL_COMPRESS;
+			break;
+		case (OPT_CPU):
+			flags |= lktrace::CTL_CPU;
+			break;
+		case (OPT_STACK_DEPTH):
+			stack_depth = std::min<uint32_t>(strtoul(optarg, nullptr, 10), MAX_STACK_DEPTH);
+			break;
 		default:
 			assert(false && "Default block in option parsing reached!");
 		}
@@ -92,7 +115,7 @@ int main (int argc, char** argv) {
 		*so_lsep = '\0';
 		wr_path = so_path;
 	}
-	size_t ctl_sz = sizeof(uint32_t) +
+	size_t ctl_sz = 3*sizeof(uint32_t) +
 		prefix.size() + 1 +
 		strlen(wr_path) + 1 +
 		strlen(target_path) + 1;
@@ -106,6 +129,10 @@ int main (int argc, char** argv) {
 	uint32_t *num_pt = (uint32_t*) ctl_v;
 	*num_pt = trace_skip;
 	++num_pt;
+	*num_pt = flags;
+	++num_pt;
+	*num_pt = stack_depth;
+	++num_pt;
 	char* str_pt = (char*) num_pt;
 	strcpy(str_pt, prefix.c_str());
 	str_pt += (prefix.size() + 1);
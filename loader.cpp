@@ -0,0 +1,430 @@
+// trace file decoding for the parser (binary and text formats)
+// all formats are decoded in parallel per thread, straight into the event store
+#include "parser.h"
+#include "lz.h"
+#include "parallel.h"
+
+#include <charconv> // from_chars()
+
+// assert that the next char is c and skip it
+#define CHECKED_SKIP(p, c) \
+	assert(*(p) == (c) && "Malformed trace!"); \
+	++(p) // semicolon absence intentional
+
+namespace lktrace {
+
+// per-thread numbering of object and caller addresses, for formats that
+// store addresses rather than dictionary ids (text and version 1)
+// ids are made global by parser::merge_ids()
+struct local_ids {
+	std::unordered_map<size_t, uint32_t> obj_ids, caller_ids;
+	std::vector<size_t> objs, callers; // by local id
+	// consecutive events mostly repeat the last address
+	size_t last_obj = SIZE_MAX, last_caller = SIZE_MAX;
+	uint32_t obj_id = 0, caller_id = 0;
+
+	static uint32_t get (std::unordered_map<size_t, uint32_t>& ids,
+			std::vector<size_t>& addrs, size_t a) {
+		auto r = ids.emplace(a, (uint32_t) addrs.size());
+		if (r.second) addrs.push_back(a);
+		return r.first->second;
+	}
+
+	uint32_t obj (size_t a) {
+		if (a != last_obj) obj_id = get(obj_ids, objs, last_obj = a);
+		return obj_id;
+	}
+
+	uint32_t caller (size_t a) {
+		if (a != last_caller) caller_id = get(caller_ids, callers, last_caller = a);
+		return caller_id;
+	}
+};
+
+// put an event in the store at i
+static inline void put_event (event_store& S, size_t i, size_t ts, event ev,
+		uint32_t obj, uint32_t caller, uint32_t thrd, uint32_t ctx = 0,
+		uint16_t cpu = NO_CPU) {
+	S.ts[i] = ts;
+	S.ev[i] = ev;
+	S.obj[i] = obj;
+	S.caller[i] = caller;
+	S.thrd[i] = thrd;
+	if (S.with_ctx) S.ctx[i] = ctx;
+	if (S.with_cpu) S.cpu[i] = cpu;
+}
+
+// expand a repeated critical section (SECT_RPT entry) at i by copying
+// the len entries before it, with the timing deltas given by next_delta()
+// begin and end bound the entries of the thread being decoded
+template <class D>
+static void expand_repeat (event_store& S, size_t& i, size_t ts, size_t len,
+		size_t begin, size_t end, D next_delta) {
+	assert(i - begin >= len && i + len <= end && "Repeat of missing section!");
+	for (size_t k = 0; k < len; ++k, ++i) {
+		if (k > 0) ts += next_delta();
+		S.copy(i, i - len);
+		S.ts[i] = ts;
+	}
+}
+
+// decode count version 1 (fixed-width) records into the store at i
+static const char* decode_v1 (const char* p, event_store& S, size_t& i, size_t count,
+		size_t begin, uint32_t thrd, local_ids& ids) {
+	size_t end = i + count;
+	while (i < end) {
+		event_record R;
+		memcpy(&R, p, sizeof(event_record));
+		p += sizeof(event_record);
+		if ((event) R.ev == event::SECT_RPT) {
+			const char* d = p;
+			expand_repeat(S, i, R.ts, R.obj, begin, end, [&d] () {
+				uint32_t v;
+				memcpy(&v, d, sizeof(uint32_t));
+				d += sizeof(uint32_t);
+				return v;
+			});
+			p += ((R.obj - 1) * sizeof(uint32_t) + 7) & ~((size_t) 7);
+			continue;
+		}
+		put_event(S, i++, R.ts, (event) R.ev, ids.obj(R.obj), ids.caller(R.caller), thrd);
+	}
+	return p;
+}
+
+// decode count version 2 (delta + varint) records into the store at i
+// dictionary ids are used as the store's object and caller ids
+// records have calling context node ids if ctx (less than n_cct), and cpu
+// ids if cpu
+static const char* decode_v2 (const char* p, event_store& S, size_t& i, size_t count,
+		size_t begin, uint32_t thrd, size_t n_objs, size_t n_callers, bool ctx,
+		size_t n_cct, bool cpu) {
+	size_t end = i + count;
+	size_t ts = 0;
+	while (i < end) {
+		ts += get_varint(p);
+		event ev = unpack_ev((uint8_t) *p++);
+		if (ev == event::SECT_RPT) {
+			size_t len = get_varint(p);
+			expand_repeat(S, i, ts, len, begin, end, [&p] () {return get_varint(p);});
+			continue;
+		}
+		size_t obj = get_varint(p);
+		size_t caller = get_varint(p);
+		assert(obj < n_objs && caller < n_callers && "Bad dictionary id!");
+		size_t cx = (ctx) ? get_varint(p) : 0;
+		assert((!ctx || cx < n_cct) && "Bad calling context!");
+		size_t cp = (cpu) ? get_varint(p) : NO_CPU;
+		assert(cp <= NO_CPU && "Bad cpu id!");
+		put_event(S, i++, ts, ev, (uint32_t) obj, (uint32_t) caller, thrd, (uint32_t) cx,
+			(uint16_t) cp);
+	}
+	return p;
+}
+
+// get the (decompressed if necessary) payload of a block
+// raw is scratch space that backs the payload of compressed blocks
+const char* block_payload (const char* buf, const index_entry& I,
+		std::string& raw, const char*& end) {
+	block_header bh;
+	memcpy(&bh, buf + I.offset, sizeof(block_header));
+	assert(bh.type == I.type);
+	const char* p = buf + I.offset + sizeof(block_header);
+	end = p + bh.size;
+	if (bh.flags & BLK_LZ) {
+		uint64_t sizes[2]; // raw, compressed
+		memcpy(sizes, p, sizeof(sizes));
+		raw.resize(sizes[0]);
+		lz_decompress(p + sizeof(sizes), sizes[1], &raw[0], raw.size());
+		p = raw.data();
+		end = p + raw.size();
+	}
+	return p;
+}
+
+// read the header, index, dictionary and string table of a binary trace,
+// and lay out its threads (see tracefmt.h)
+void parser::read_index (const char* buf, size_t sz) {
+	memcpy(&hdr, buf, sizeof(file_header));
+	assert((hdr.version == 1 || hdr.version == TRACE_VERSION)
+			&& "Unsupported trace version!");
+	file_footer ftr;
+	memcpy(&ftr, buf + sz - sizeof(file_footer), sizeof(file_footer));
+	assert(memcmp(ftr.magic, INDEX_MAGIC, sizeof(ftr.magic)) == 0
+			&& "Trace index missing!");
+	assert(ftr.index_offset + ftr.index_count*sizeof(index_entry)
+			+ sizeof(file_footer) == sz && "Trace index corrupt!");
+	index.resize(ftr.index_count);
+	memcpy(index.data(), buf + ftr.index_offset, ftr.index_count * sizeof(index_entry));
+
+	std::unordered_map<size_t, size_t> block_ind;
+	std::string raw;
+	std::vector<uint64_t> locksets; // see select_blocks()
+
+	for (const index_entry& I : index) {
+		if (I.type == block_type::THREAD) {
+			auto ind_it = block_ind.find(I.tid);
+			if (ind_it == block_ind.end()) {
+				ind_it = block_ind.emplace(I.tid, thrd_blocks.size()).first;
+				thrd_blocks.emplace_back();
+			}
+			thrd_blocks[ind_it->second].push_back(&I);
+			continue;
+		}
+
+		const char* end;
+		const char* p = block_payload(buf, I, raw, end);
+		if (I.type == block_type::DICT) { // version 2
+			uint64_t counts[2];
+			memcpy(counts, p, sizeof(counts));
+			p += sizeof(counts);
+			assert(counts[0] < UINT32_MAX && counts[1] < UINT32_MAX);
+			objs.resize(counts[0]);
+			callers.resize(counts[1]);
+			memcpy(objs.data(), p, counts[0] * sizeof(uint64_t));
+			p += counts[0] * sizeof(uint64_t);
+			memcpy(callers.data(), p, counts[1] * sizeof(uint64_t));
+			p += counts[1] * sizeof(uint64_t);
+		} else if (I.type == block_type::STRTAB) {
+			for (size_t n = 0; n < I.count; ++n) {
+				uint64_t addr;
+				uint32_t len;
+				memcpy(&addr, p, sizeof(uint64_t));
+				memcpy(&len, p + sizeof(uint64_t), sizeof(uint32_t));
+				p += sizeof(uint64_t) + sizeof(uint32_t);
+				add_symbol(addr, std::string_view(p, len));
+				p += len;
+			}
+		} else if (I.type == block_type::CCT) { // after the dictionary
+			cct.resize(I.count + 1);
+			cct[0] = {0, UINT32_MAX};
+			for (size_t k = 1; k <= I.count; ++k) {
+				cct[k].parent = (uint32_t) get_varint(p);
+				cct[k].caller = (uint32_t) get_varint(p);
+				assert(cct[k].parent < k && cct[k].caller < callers.size()
+						&& "Bad calling context!");
+			}
+			store.with_ctx = true;
+		} else if (I.type == block_type::TOPOLOGY) {
+			topo.resize(I.count);
+			for (cpu_topo& T : topo) {
+				T.core = (uint32_t) get_varint(p);
+				T.llc = (uint32_t) get_varint(p);
+				T.node = (uint32_t) get_varint(p);
+			}
+			store.with_cpu = true;
+		} else if (I.type == block_type::LOCKSET) {
+			locksets.resize(I.count * LOCKSET_WORDS);
+			memcpy(locksets.data(), p, locksets.size() * sizeof(uint64_t));
+			p += locksets.size() * sizeof(uint64_t);
+		}
+		assert(p <= end && "Block overrun!");
+	}
+	if (qry.active) select_blocks(locksets);
+
+	// event counts are in the index, so threads are laid out up front
+	size_t total = 0;
+	for (auto& blocks : thrd_blocks) {
+		thrd_info T = {blocks.front()->tid, 0, total, total};
+		for (const index_entry* I : blocks) T.end += I->count;
+		total = T.end;
+		thrd_ind.emplace(T.tid, thrds.size());
+		thrds.push_back(T);
+	}
+}
+
+// parse the binary format (see tracefmt.h)
+void parser::load_binary (const char* buf, size_t sz) {
+	read_index(buf, sz);
+	store.resize(thrds.empty() ? 0 : thrds.back().end);
+
+	// threads are independent, so decode them in parallel
+	std::vector<local_ids> ids ((hdr.version == 1) ? thrds.size() : 0);
+	parallel_for(thrd_blocks.size(), [&] (size_t t) {
+		size_t i = thrds[t].begin;
+		std::string raw;
+		for (const index_entry* I : thrd_blocks[t]) {
+			const char* end;
+			const char* p = block_payload(buf, *I, raw, end);
+			thread_block_header th;
+			memcpy(&th, p, sizeof(thread_block_header));
+			p += sizeof(thread_block_header);
+			thrds[t].hook = th.hook;
+			if (hdr.version == 1)
+				p = decode_v1(p, store, i, I->count, thrds[t].begin, (uint32_t) t, ids[t]);
+			else p = decode_v2(p, store, i, I->count, thrds[t].begin, (uint32_t) t,
+					objs.size(), callers.size(), I->flags & BLK_CTX, cct.size(),
+					I->flags & BLK_CPU);
+			assert(p <= end && "Block overrun!");
+		}
+	});
+	if (hdr.version == 1) merge_ids(ids);
+	// the store has the events now
+	thrd_blocks.clear();
+	index.clear();
+}
+
+// parse 0x-prefixed hex
+static const char* parse_hex (const char* p, const char* end, size_t& v) {
+	CHECKED_SKIP(p, '0');
+	CHECKED_SKIP(p, 'x');
+	auto r = std::from_chars(p, end, v, 16);
+	assert(r.ec == std::errc() && "Malformed trace!");
+	return r.ptr;
+}
+
+// count the events of a text thread block, with repeated sections expanded
+static size_t count_text (const char* p, const char* end) {
+	size_t n = 0;
+	while (p < end) {
+		const char* eol = (const char*) memchr(p, '\n', end - p);
+		const char* ev = (const char*) memchr(p, ':', eol - p);
+		assert(ev && "Malformed trace!");
+		if (ev[1] == 'R' && ev[2] == 'S') {
+			size_t len;
+			parse_hex(ev + 4, eol, len);
+			n += len;
+		} else ++n;
+		p = eol + 1;
+	}
+	return n;
+}
+
+// parse the count events of a text thread block into the store at i
+static void decode_text (const char* p, const char* end, event_store& S, size_t i,
+		size_t count, uint32_t thrd, local_ids& ids) {
+	size_t begin = i;
+	size_t s_end = i + count;
+	while (p < end) {
+		size_t ts, obj, caller;
+		auto r = std::from_chars(p, end, ts);
+		assert(r.ec == std::errc() && "Malformed trace!");
+		p = r.ptr;
+		CHECKED_SKIP(p, ':');
+		event ev = ev_str_to_code(std::string_view(p, 2));
+		p += 2;
+		CHECKED_SKIP(p, ':');
+		p = parse_hex(p, end, obj);
+		CHECKED_SKIP(p, ':');
+
+		if (ev == event::SECT_RPT) {
+			// deltas are comma separated
+			expand_repeat(S, i, ts, obj, begin, s_end, [&] () {
+				uint32_t d;
+				r = std::from_chars(p, end, d);
+				assert(r.ec == std::errc() && "Malformed trace!");
+				p = r.ptr;
+				if (*p == ',') ++p;
+				return d;
+			});
+			CHECKED_SKIP(p, '\n');
+			continue;
+		}
+		p = parse_hex(p, end, caller);
+		CHECKED_SKIP(p, '\n');
+
+		assert(i < s_end);
+		put_event(S, i++, ts, ev, ids.obj(obj), ids.caller(caller), thrd);
+	}
+}
+
+// parse the old hex text format
+void parser::load_text (const char* buf, size_t sz) {
+	const char* end = buf + sz;
+	// thread blocks: event lines and their history
+	std::vector<std::pair<const char*, const char*> > tblocks;
+
+	// pre-scan for blocks: each starts with a [x:...] line
+	// and is ended by an empty line
+	const char* p = buf;
+	while (p < end) {
+		CHECKED_SKIP(p, '[');
+		const char* bend = p;
+		while (1) { // memchr is vectorized
+			bend = (const char*) memchr(bend, '\n', end - bend);
+			assert(bend && "Unterminated block!");
+			++bend;
+			assert(bend < end && "Unterminated block!");
+			if (*bend == '\n') break;
+		}
+
+		char bdes = *p; // block designator
+		p += 1;
+		CHECKED_SKIP(p, ':');
+		if (bdes == 't' || bdes == 'm') { // a thread block
+			size_t tid, hook;
+			p = parse_hex(p, bend, tid);
+			CHECKED_SKIP(p, ':');
+			p = parse_hex(p, bend, hook);
+			CHECKED_SKIP(p, ']');
+			CHECKED_SKIP(p, '\n');
+			assert(thrd_ind.find(tid) == thrd_ind.end() && "Duplicate thread!");
+			thrd_ind.emplace(tid, thrds.size());
+			thrds.push_back({tid, hook, 0, 0});
+			tblocks.push_back(std::make_pair(p, bend));
+		} else if (bdes == 'n') { // a string table block
+			CHECKED_SKIP(p, ']');
+			CHECKED_SKIP(p, '\n');
+			while (p < bend) {
+				size_t addr;
+				p = parse_hex(p, bend, addr);
+				CHECKED_SKIP(p, ':');
+				const char* eol = (const char*) memchr(p, '\n', bend - p);
+				add_symbol(addr, std::string_view(p, eol - p));
+				p = eol + 1;
+			}
+		}
+		p = bend + 1;
+	}
+
+	// count events to lay out threads, then decode in parallel
+	std::vector<size_t> counts (tblocks.size());
+	parallel_for(tblocks.size(), [&] (size_t t) {
+		counts[t] = count_text(tblocks[t].first, tblocks[t].second);
+	});
+	size_t total = 0;
+	for (size_t t = 0; t < thrds.size(); ++t) {
+		thrds[t].begin = total;
+		total += counts[t];
+		thrds[t].end = total;
+	}
+	store.resize(total);
+	std::vector<local_ids> ids (thrds.size());
+	parallel_for(tblocks.size(), [&] (size_t t) {
+		decode_text(tblocks[t].first, tblocks[t].second, store, thrds[t].begin,
+			counts[t], (uint32_t) t, ids[t]);
+	});
+	merge_ids(ids);
+}
+
+// number the threads' local object and caller ids globally, in thread order,
+// and rewrite the store's id columns with them
+void parser::merge_ids (std::vector<local_ids>& ids) {
+	std::unordered_map<size_t, uint32_t> obj_id;
+	std::unordered_map<size_t, uint32_t> caller_id;
+	std::vector<std::vector<uint32_t> > o_map (ids.size()), c_map (ids.size());
+	for (size_t t = 0; t < ids.size(); ++t) {
+		for (size_t o : ids[t].objs) {
+			auto r = obj_id.emplace(o, (uint32_t) objs.size());
+			if (r.second) objs.push_back(o);
+			o_map[t].push_back(r.first->second);
+		}
+		for (size_t c : ids[t].callers) {
+			auto r = caller_id.emplace(c, (uint32_t) callers.size());
+			if (r.second) callers.push_back(c);
+			c_map[t].push_back(r.first->second);
+		}
+		ids[t] = local_ids();
+	}
+	assert(objs.size() < UINT32_MAX && callers.size() < UINT32_MAX);
+	parallel_for(ids.size(), [&] (size_t t) {
+		const uint32_t* om = o_map[t].data();
+		const uint32_t* cm = c_map[t].data();
+		for (size_t i = thrds[t].begin; i < thrds[t].end; ++i) {
+			store.obj[i] = om[store.obj[i]];
+			store.caller[i] = cm[store.caller[i]];
+		}
+	});
+}
+
+} // namespace lktrace
@@ -0,0 +1,85 @@
+// per-lock contention statistics
+#include "parser.h"
+#include "parallel.h"
+
+#include <algorithm> // sort()
+
+// callsites shown per lock
+#define TOP_CALLSITES 5
+
+namespace lktrace {
+
+// fill S with the results of a finished lock scanner
+void lock_result (lock_scanner& L, lock_stats& S) {
+	S.acqs = L.acqs;
+	S.contended = L.contended;
+	S.total_wait = L.total_wait;
+	S.total_hold = L.total_hold;
+	L.waits.percentiles(S.wait_pct);
+	L.holds.percentiles(S.hold_pct);
+
+	S.callsites.clear();
+	for (auto& site : L.sites)
+		S.callsites.emplace_back(site.first, site.second.first, site.second.second);
+	std::sort(S.callsites.begin(), S.callsites.end(), [] (auto& a, auto& b) {
+		return std::get<2>(a) > std::get<2>(b) ||
+			(std::get<2>(a) == std::get<2>(b) && std::get<0>(a) < std::get<0>(b));
+	});
+}
+
+// compute lock_stats for every acquired lock from its history
+// (see lock_scanner for what is counted)
+// this walks the histories itself rather than through scan_locks(), so each
+// lock's scanner, which keeps all of its waits and holds for the
+// percentiles, is done with before the worker moves on; in streaming mode
+// the samples are capped and the scan is part of stream_find()
+void parser::find_locks (size_t threshold) {
+	lk_stats.assign(objs.size(), lock_stats());
+	parallel_for(objs.size(), [&] (size_t o) {
+		lock_scanner L;
+		for (size_t k = lk_begin[o]; k < lk_begin[o+1]; ++k) {
+			size_t R = lk_hist[k];
+			L.add(store.ev[R], store.thrd[R], store.caller[R], store.ts[R], threshold);
+		}
+		lk_stats[o].obj = (uint32_t) o;
+		lock_result(L, lk_stats[o]);
+	});
+	rank_locks();
+}
+
+// keep locks only, worst total wait first
+void parser::rank_locks () {
+	lk_stats.erase(std::remove_if(lk_stats.begin(), lk_stats.end(),
+		[] (const lock_stats& S) {return S.acqs == 0;}), lk_stats.end());
+	std::sort(lk_stats.begin(), lk_stats.end(),
+		[] (const lock_stats& a, const lock_stats& b) {
+			if (a.total_wait != b.total_wait) return a.total_wait > b.total_wait;
+			if (a.acqs != b.acqs) return a.acqs > b.acqs;
+			return a.obj < b.obj;
+	});
+}
+
+void parser::dump_locks (std::ostream& outs) {
+	for (lock_stats& S : lk_stats) {
+		outs << "Lock 0x" << std::hex << objs[S.obj];
+		put_obj_pid(outs, S.obj);
+		outs << ": " << S.acqs << " acquisitions, " << S.contended << " contended\n";
+		outs << "\twait: total " << S.total_wait << ", p50 " << S.wait_pct[0]
+			<< ", p90 " << S.wait_pct[1] << ", p99 " << S.wait_pct[2]
+			<< ", max " << S.wait_pct[3] << " ticks\n";
+		outs << "\thold: total " << S.total_hold << ", p50 " << S.hold_pct[0]
+			<< ", p90 " << S.hold_pct[1] << ", p99 " << S.hold_pct[2]
+			<< ", max " << S.hold_pct[3] << " ticks\n";
+		size_t n = std::min<size_t>(S.callsites.size(), TOP_CALLSITES);
+		for (size_t k = 0; k < n; ++k) {
+			uint32_t caller_id = std::get<0>(S.callsites[k]);
+			size_t caller = callers[caller_id];
+			outs << "\tcontended " << std::get<1>(S.callsites[k]) << " time(s), waited "
+				<< std::get<2>(S.callsites[k]) << " ticks @" << caller_names[caller_id]
+				<< " [0x" << std::hex << caller << "]\n" << std::dec;
+		}
+		outs << '\n';
+	}
+}
+
+} // namespace lktrace
@@ -0,0 +1,107 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <string>
+#include <vector>
+
+// minimal LZ77 block codec in the style of LZ4, used for optional
+// compression of trace blocks (no external dependency)
+//
+// a compressed block is a sequence of:
+//	token byte: literal length (high nibble), match length - LZ_MIN_MATCH (low)
+//	extra literal length bytes if the nibble is 15 (255 = continue)
+//	literals
+//	uint16 match offset, extra match length bytes if the nibble is 15
+// the last sequence has literals only
+
+namespace lktrace {
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+
+inline void lz_put_len (std::string& out, size_t len) {
+	while (len >= 255) {
+		out += (char) 255;
+		len -= 255;
+	}
+	out += (char) len;
+}
+
+// append the compressed form of src to out
+inline void lz_compress (const char* src, size_t n, std::string& out) {
+	std::vector<uint32_t> table (1 << LZ_HASH_BITS, UINT32_MAX);
+	size_t anchor = 0;
+
+	// emit literals [anchor, lit_end) and a match (len 0 = last sequence)
+	auto emit = [&] (size_t lit_end, size_t len, size_t off) {
+		size_t lit = lit_end - anchor;
+		size_t ml = (len) ? len - LZ_MIN_MATCH : 0;
+		out += (char) (((lit < 15) ? lit : 15) << 4 | ((ml < 15) ? ml : 15));
+		if (lit >= 15) lz_put_len(out, lit - 15);
+		out.append(src + anchor, lit);
+		if (len) {
+			out += (char) (off & 0xff);
+			out += (char) (off >> 8);
+			if (ml >= 15) lz_put_len(out, ml - 15);
+		}
+	};
+
+	size_t i = 0;
+	while (i + LZ_MIN_MATCH <= n) {
+		uint32_t v;
+		memcpy(&v, src + i, sizeof(uint32_t));
+		uint32_t h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+		size_t cand = table[h];
+		table[h] = (uint32_t) i;
+		if (cand != UINT32_MAX && i - cand <= 0xffff &&
+				memcmp(src + cand, src + i, LZ_MIN_MATCH) == 0) {
+			size_t len = LZ_MIN_MATCH;
+			while (i + len < n && src[cand + len] == src[i + len]) ++len;
+			emit(i, len, i - cand);
+			i += len;
+			anchor = i;
+		} else ++i;
+	}
+	emit(n, 0, 0);
+}
+
+// decompress src into dst, which must be exactly the raw size
+inline void lz_decompress (const char* src, size_t n, char* dst, size_t dst_n) {
+	const uint8_t* s = (const uint8_t*) src;
+	const uint8_t* end = s + n;
+	size_t o = 0;
+
+	auto get_len = [&] (size_t len) {
+		uint8_t b;
+		do {
+			b = *s++;
+			len += b;
+		} while (b == 255);
+		return len;
+	};
+
+	while (s < end) {
+		uint8_t tok = *s++;
+		size_t lit = tok >> 4;
+		if (lit == 15) lit = get_len(lit);
+		assert(o + lit <= dst_n && s + lit <= end && "Corrupt LZ block!");
+		memcpy(dst + o, s, lit);
+		s += lit;
+		o += lit;
+		if (s >= end) break; // last sequence
+
+		size_t off = s[0] | (s[1] << 8);
+		s += 2;
+		size_t len = tok & 0x0f;
+		if (len == 15) len = get_len(len);
+		len += LZ_MIN_MATCH;
+		assert(off > 0 && off <= o && o + len <= dst_n && "Corrupt LZ block!");
+		if (off >= len) memcpy(dst + o, dst + o - off, len);
+		else for (size_t k = 0; k < len; ++k) dst[o + k] = dst[o + k - off];
+		o += len;
+	}
+	assert(o == dst_n && "Corrupt LZ block!");
+}
+
+} // namespace lktrace
@@ -0,0 +1,105 @@
+// lock migration between cpus: how often a lock is acquired on a cpu away
+// from the one it was last released on (another core, last level cache or
+// NUMA node, by the topology recorded with the trace), and how long the
+// holds after such a handoff last, as the lock's cache line and the data
+// it guards are pulled over from the previous owner (see migration_scanner)
+#include "parser.h"
+
+#include <memory> // unique_ptr
+#include <algorithm> // sort()
+
+namespace lktrace {
+
+namespace {
+
+// fill S with the results of a finished migration scanner
+void migration_result (const migration_scanner& M, migration_stats& S) {
+	S.acqs = M.acqs;
+	for (size_t d = 0; d < CPU_DISTS; ++d) {
+		S.handoffs[d] = M.handoffs[d];
+		S.from_other[d] = M.from_other[d];
+		S.holds[d] = M.holds_done[d];
+		S.hold_total[d] = M.hold_total[d];
+	}
+}
+
+// handoffs of S at distance at least d
+size_t handoffs_from (const migration_stats& S, size_t d) {
+	size_t n = 0;
+	for (; d < CPU_DISTS; ++d) n += S.handoffs[d];
+	return n;
+}
+
+} // namespace
+
+// compute migration_stats for every lock acquired after a release with
+// known cpus
+void parser::find_migration () {
+	migration.clear();
+	if (topo.empty()) return;
+	std::vector<migration_stats> M (objs.size());
+	std::vector<std::unique_ptr<migration_scanner> > S (objs.size());
+	scan_locks([&] (uint32_t o, const event_store& E, size_t i) {
+		if (!S[o]) S[o].reset(new migration_scanner(topo));
+		S[o]->add(E.ev[i], E.thrd[i], E.ts[i], (E.with_cpu) ? E.cpu[i] : NO_CPU);
+	});
+	for (size_t o = 0; o < objs.size(); ++o) {
+		M[o].obj = (uint32_t) o;
+		if (S[o]) migration_result(*S[o], M[o]);
+	}
+
+	for (migration_stats& S : M)
+		if (handoffs_from(S, SAME_CPU) > 0) migration.push_back(S);
+	std::sort(migration.begin(), migration.end(),
+		[] (const migration_stats& a, const migration_stats& b) {
+			for (size_t d = OTHER_NODE; d > SAME_CPU; --d)
+				if (handoffs_from(a, d) != handoffs_from(b, d))
+					return handoffs_from(a, d) > handoffs_from(b, d);
+			if (a.acqs != b.acqs) return a.acqs > b.acqs;
+			return a.obj < b.obj;
+	});
+}
+
+void parser::dump_migration (std::ostream& outs) {
+	if (topo.empty()) {
+		outs << "Lock migration: no cpu ids in the trace (record with lktrace --cpu).\n\n";
+		return;
+	}
+	const char* where[CPU_DISTS] = {"the same cpu", "the same core", "the same LLC",
+		"the same node", "another node"};
+	for (const migration_stats& S : migration) {
+		size_t placed = handoffs_from(S, SAME_CPU);
+		outs << "Lock 0x" << std::hex << objs[S.obj];
+		put_obj_pid(outs, S.obj);
+		outs << ": " << S.acqs
+			<< " acquisitions, " << placed << " after a release on a known cpu\n";
+		for (size_t d = 0; d < CPU_DISTS; ++d) {
+			if (S.handoffs[d] == 0) continue;
+			outs << "\treleased on " << where[d] << ": " << S.handoffs[d] << " ("
+				<< S.from_other[d] << " by another thread)";
+			if (S.holds[d] > 0)
+				outs << ", mean hold " << to_ns(S.hold_total[d] / S.holds[d]) << " ns";
+			outs << '\n';
+		}
+		outs << "\tmigrated across cores " << handoffs_from(S, SAME_LLC) << " times ("
+			<< handoffs_from(S, SAME_LLC) * 100 / placed << "%), across LLCs "
+			<< handoffs_from(S, SAME_NODE) << " (" << handoffs_from(S, SAME_NODE) * 100 / placed
+			<< "%), across nodes " << S.handoffs[OTHER_NODE] << " ("
+			<< S.handoffs[OTHER_NODE] * 100 / placed << "%)\n";
+		// local: the previous owner shared the last level cache
+		size_t n[2] = {}, t[2] = {};
+		for (size_t d = 0; d < CPU_DISTS; ++d) {
+			n[d >= SAME_NODE] += S.holds[d];
+			t[d >= SAME_NODE] += S.hold_total[d];
+		}
+		outs << "\tmean hold after a local handoff (shared LLC): ";
+		if (n[0] > 0) outs << to_ns(t[0] / n[0]) << " ns";
+		else outs << '-';
+		outs << ", after a remote one: ";
+		if (n[1] > 0) outs << to_ns(t[1] / n[1]) << " ns";
+		else outs << '-';
+		outs << "\n\n";
+	}
+}
+
+} // namespace lktrace
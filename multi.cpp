@@ -0,0 +1,178 @@
+// multi-process analysis: the traces of a process tree (one per process)
+// are loaded in parallel and their timestamps aligned on the earliest
+// CLOCK_MONOTONIC base in their headers; they are then analyzed one by one,
+// or merged into a single parser for the whole tree
+#include "parser.h"
+#include "parallel.h"
+
+#include <map>
+#include <algorithm> // min(), any_of()
+
+namespace lktrace {
+
+// load the traces in fnames, in parallel, keeping the events matching q
+// timestamps are shifted to count from the earliest trace's start, so events
+// of different processes compare in time (text traces have no clock base,
+// and are left as they are)
+std::vector<std::unique_ptr<parser> > parser::load_all (
+		const std::vector<std::string>& fnames, bool cache, const query& q) {
+	// the clock bases are in the headers
+	std::vector<file_header> hdrs (fnames.size());
+	uint64_t base = UINT64_MAX;
+	for (size_t k = 0; k < fnames.size(); ++k) {
+		file_header& h = hdrs[k];
+		std::ifstream f (fnames[k], std::ios::binary);
+		if (!f.read((char*) &h, sizeof(file_header))
+				|| memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0)
+			memset(&h, 0, sizeof(file_header));
+		if (h.mono_base) base = std::min(base, h.mono_base);
+	}
+	std::vector<size_t> shifts (fnames.size(), 0);
+	for (size_t k = 0; k < fnames.size(); ++k) {
+		const file_header& h = hdrs[k];
+		if (!h.mono_base) continue;
+		assert(h.tick_num == hdrs[0].tick_num && h.tick_den == hdrs[0].tick_den
+				&& "Traces have different clocks!");
+		// base difference in ticks: ns * den / (num * 1e9)
+		unsigned __int128 ns = h.mono_base - base;
+		shifts[k] = (size_t) (ns * h.tick_den / (h.tick_num * 1000000000ull));
+	}
+
+	// the query's times are from the earliest start too
+	std::vector<std::unique_ptr<parser> > P (fnames.size());
+	parallel_for(fnames.size(), [&] (size_t k) {
+		query qk = q;
+		qk.to_ticks(hdrs[k]);
+		qk.shift(shifts[k]);
+		P[k].reset(new parser(fnames[k], 0, cache, qk));
+	});
+
+	for (size_t k = 0; k < P.size(); ++k) {
+		parser& p = *P[k];
+		if (!shifts[k]) continue;
+		parallel_for(p.thrds.size(), [&] (size_t t) {
+			for (size_t i = p.thrds[t].begin; i < p.thrds[t].end; ++i)
+				p.store.ts[i] += shifts[k];
+		});
+		p.hdr.mono_base = base;
+	}
+	return P;
+}
+
+// merge the (aligned) traces in P into one, emptying them
+// objects are identified by process and address, since forked processes
+// have private locks at the same addresses, or by address alone if shared
+// is set, so a process-shared lock is one object; callers are identified by
+// address and name, since processes that exec'd other programs reuse
+// addresses; a tid found in several processes maps to no thread in thrd_ind
+parser::parser (std::vector<std::unique_ptr<parser> >& P, bool shared) :
+	store(), thrds(), lk_hist(), lk_begin(), thrd_hooks(), caller_names(),
+	window(0), buf(nullptr), buf_sz(0), cache_buf(nullptr), cache_sz(0),
+	cache_global(nullptr) {
+
+	memset(&hdr, 0, sizeof(file_header));
+	if (!P.empty()) {
+		hdr = P[0]->hdr;
+		hdr.pid = 0;
+	}
+
+	// global ids for each trace's object and caller ids, and the layout of
+	// the merged store
+	std::vector<std::vector<uint32_t> > obj_map (P.size()), caller_map (P.size());
+	std::vector<size_t> at (P.size() + 1, 0);
+	std::map<std::pair<uint32_t, size_t>, uint32_t> obj_ids;
+	std::unordered_map<std::string_view, std::unordered_map<size_t, uint32_t> > caller_ids;
+	std::vector<std::pair<size_t, size_t> > names; // in sym_arena, by caller id
+	std::vector<std::pair<size_t, size_t> > hooks; // in sym_arena, by thread
+	// calling context trees are appended under one root, so trace k's
+	// nodes are offset by cct_at[k]; a trace without stacks gets a node
+	// per caller (caller id + 1), so its events still have their callsite
+	std::vector<uint32_t> cct_at (P.size(), 0);
+	bool any_ctx = std::any_of(P.begin(), P.end(),
+		[] (const std::unique_ptr<parser>& p) {return !p->cct.empty();});
+	if (any_ctx) cct.push_back({0, UINT32_MAX});
+	// the processes ran on one machine, so they share a topology; events of
+	// a trace without cpu ids have an unknown cpu
+	for (auto& p : P)
+		if (p->topo.size() > topo.size()) topo = p->topo;
+	auto intern = [this] (std::string_view s) {
+		std::pair<size_t, size_t> r (sym_arena.size(), s.size());
+		sym_arena.append(s);
+		return r;
+	};
+	for (size_t k = 0; k < P.size(); ++k) {
+		parser& p = *P[k];
+		if (!shared) proc_pids.push_back(p.hdr.pid);
+		for (size_t o : p.objs) {
+			uint32_t proc = (shared) ? 0 : (uint32_t) k;
+			auto r = obj_ids.emplace(std::make_pair(proc, o), (uint32_t) objs.size());
+			if (r.second) {
+				objs.push_back(o);
+				if (!shared) obj_procs.push_back(proc);
+			}
+			obj_map[k].push_back(r.first->second);
+		}
+		for (size_t c = 0; c < p.callers.size(); ++c) {
+			auto& ids = caller_ids[p.caller_names[c]];
+			auto r = ids.emplace(p.callers[c], (uint32_t) callers.size());
+			if (r.second) {
+				callers.push_back(p.callers[c]);
+				names.push_back(intern(p.caller_names[c]));
+			}
+			caller_map[k].push_back(r.first->second);
+		}
+		cct_at[k] = (uint32_t) cct.size() - 1;
+		for (size_t n = 1; n < p.cct.size(); ++n) {
+			uint32_t parent = p.cct[n].parent;
+			cct.push_back({(parent == 0) ? 0 : parent + cct_at[k],
+				caller_map[k][p.cct[n].caller]});
+		}
+		if (any_ctx && p.cct.empty())
+			for (uint32_t c : caller_map[k]) cct.push_back({0, c});
+		for (size_t t = 0; t < p.thrds.size(); ++t) {
+			thrd_info T = p.thrds[t];
+			T.begin += at[k];
+			T.end += at[k];
+			auto r = thrd_ind.emplace(T.tid, thrds.size());
+			if (!r.second) r.first->second = UINT32_MAX;
+			thrds.push_back(T);
+			thrd_pids.push_back(p.hdr.pid);
+			hooks.push_back(intern(p.thrd_hooks[t]));
+		}
+		at[k+1] = at[k] + p.store.size();
+	}
+	caller_names.reserve(callers.size());
+	for (auto& r : names) caller_names.emplace_back(sym_arena.data() + r.first, r.second);
+	thrd_hooks.reserve(thrds.size());
+	for (auto& r : hooks) thrd_hooks.emplace_back(sym_arena.data() + r.first, r.second);
+
+	// copy the events over with global ids; threads are renumbered in order
+	store.with_ctx = !cct.empty();
+	store.with_cpu = !topo.empty();
+	store.resize(at.back());
+	std::vector<uint32_t> thrd_at (P.size() + 1, 0);
+	for (size_t k = 0; k < P.size(); ++k)
+		thrd_at[k+1] = thrd_at[k] + (uint32_t) P[k]->thrds.size();
+	parallel_for(P.size(), [&] (size_t k) {
+		event_store& S = P[k]->store;
+		for (size_t i = 0; i < S.size(); ++i) {
+			size_t j = at[k] + i;
+			store.ts[j] = S.ts[i];
+			store.ev[j] = S.ev[i];
+			store.obj[j] = obj_map[k][S.obj[i]];
+			store.caller[j] = caller_map[k][S.caller[i]];
+			store.thrd[j] = thrd_at[k] + S.thrd[i];
+			if (store.with_cpu) store.cpu[j] = (S.with_cpu) ? S.cpu[i] : NO_CPU;
+			if (!store.with_ctx) continue;
+			if (S.with_ctx) store.ctx[j] = (S.ctx[i]) ? S.ctx[i] + cct_at[k] : 0;
+			else store.ctx[j] = cct_at[k] + S.caller[i] + 1;
+		}
+		P[k].reset();
+	});
+	P.clear();
+
+	build_xref();
+	build_lk_hist();
+}
+
+} // namespace lktrace
@@ -0,0 +1,41 @@
+#pragma once
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+namespace lktrace {
+
+// number of worker threads used by parallel passes in the parser
+inline unsigned worker_count () {
+	unsigned n = std::thread::hardware_concurrency();
+	return (n == 0) ? 1 : n;
+}
+
+// set on the threads of a parallel_for()
+inline thread_local bool in_parallel = false;
+
+// run f(i) for each i in [0, n) on a pool of worker threads
+// indices are handed out one at a time, so uneven work is balanced
+// nested calls (eg. loading several traces in parallel) run serially on
+// their worker, so the pool is not multiplied
+template <class F> void parallel_for (size_t n, F f) {
+	size_t workers = std::min<size_t>(worker_count(), n);
+	if (workers <= 1 || in_parallel) {
+		for (size_t i = 0; i < n; ++i) f(i);
+		return;
+	}
+	std::atomic<size_t> next (0);
+	auto work = [&] () {
+		bool nested = in_parallel;
+		in_parallel = true;
+		for (size_t i = next++; i < n; i = next++) f(i);
+		in_parallel = nested;
+	};
+	std::vector<std::thread> pool;
+	for (size_t w = 1; w < workers; ++w) pool.emplace_back(work);
+	work();
+	for (std::thread& t : pool) t.join();
+}
+
+} // namespace lktrace
@@ -1,210 +1,277 @@
 #include "parser.h"
 
-#define CHECKED_CONSUME(stream, c) \
-	if (stream.peek() != c) { \
-		std::cerr << "actual: "<< stream.get() << ' ' \
-			<< std::hex << stream.rdstate() << '\n'; \
-		assert(stream.peek() == c); \
-	} \
-	stream.get() // semicolon absence intentional
+#include <fcntl.h> // open()
+#include <unistd.h> // close()
+#include <sys/mman.h> // mmap()
+#include <sys/stat.h> // fstat()
+#include <algorithm> // make_heap(), sort()
 
-#define NEW_LOG(key) std::make_pair(key, std::vector<log_entry>())
-#define NEW_REFLOG(key) std::make_pair(key, std::vector<log_entry_ref>())
+#include "parallel.h"
 
 namespace lktrace {
 
-parser::parser(std::string fname) : 
-	thrd_hist(), lk_hist(), thrd_hooks() {
-	
-	std::ifstream trace (fname);
-	assert(trace.is_open());
-
-	while(trace.peek() != -1) {
-		// TODO: handle errors w/ exceptions
-		CHECKED_CONSUME(trace, '[');
-		std::string bdes; // block designator
-		getline(trace, bdes, ':');
-		if (bdes[0] == 't' || bdes[0] == 'm') { // a thread block
-			size_t tid;
-			trace >> std::hex >> tid;
-			CHECKED_CONSUME(trace, ':');
-			//if (bdes[1] == 'm') master_tid = tid;
-			size_t hook;
-			trace >> std::hex >> hook;
-			CHECKED_CONSUME(trace, ']');
-			CHECKED_CONSUME(trace, '\n');
-			// add new thread history
-			auto emplit = thrd_hist.emplace(NEW_LOG(tid));
-			assert(emplit.second == true);
-			auto thrd_l_it = emplit.first;
-			// get event entries
-			while (trace.peek() != '\n') {// double newline ends a sxn
-				log_entry L;
-				trace >> std::dec >> L.ts;
-				CHECKED_CONSUME(trace, ':');
-				std::string es;
-				getline(trace, es, ':');
-				L.ev = ev_str_to_code(es); 
-				trace >> std::hex >> L.obj;
-				CHECKED_CONSUME(trace, ':');
-				trace >> L.caller;
-				CHECKED_CONSUME(trace, '\n');
-
-				// add per-thread log entry
-				thrd_l_it->second.push_back(std::move(L));
-
-				// add xref
-				caller_xref.insert(std::make_pair(L.caller, L.obj));
-			}
-		} else if (bdes[0] == 'n') { // a string table block
-			trace.ignore(8, '\n');
-			while (trace.peek() != '\n') {
-				std::pair<size_t, std::string> tab;
-				trace >> std::hex >> tab.first;
-				CHECKED_CONSUME(trace, ':');
-				getline(trace, tab.second);
-				caller_names.insert(std::move(tab));
-			}
-		}
-		CHECKED_CONSUME(trace, '\n');
+parser::parser(std::string fname, size_t window, bool cache, const query& q) : 
+	store(), thrds(), lk_hist(), lk_begin(), thrd_hooks(), caller_names(),
+	window(window), buf(nullptr), buf_sz(0), qry(q), cache_buf(nullptr), cache_sz(0),
+	cache_global(nullptr) {
+
+	memset(&hdr, 0, sizeof(file_header));
+	int fd = open(fname.c_str(), O_RDONLY);
+	assert(fd != -1);
+	struct stat info;
+	int e = fstat(fd, &info);
+	assert(e == 0);
+	buf_sz = (size_t) info.st_size;
+	if (buf_sz > 0) {
+		buf = (const char*) mmap(NULL, buf_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+		assert(buf != MAP_FAILED);
 	}
-	trace.close();
-
-	// build global and per-object histories
-	// basically, merge sort the per-thread histories by timestamp, ascending
-	// pair of index into hist vector, and tid of hist vector
-	// TODO: this is just log_entry_ref backwards
-	// TODO: actually build per-object histories
-	std::vector<std::pair<size_t, size_t> > merge;
-	
-	for (auto it = thrd_hist.begin(); it != thrd_hist.end(); ++it)
-		merge.push_back(std::make_pair(0, it->first));
-
-	while (1) {
-		// find the min timestamp out of current top entries
-		log_entry L = {event::NULL_EVENT, std::numeric_limits<size_t>::max(), 0, 0};
-		size_t tid = 0;
-		size_t *ind = nullptr;
-		for (auto& m : merge) {
-			if (m.first < thrd_hist.at(m.second).size()
-					&& thrd_hist.at(m.second).at(m.first).ts < L.ts) {
-
-				ind = &m.first;
-				tid = m.second;
-			       	L = thrd_hist.at(m.second).at(m.first);	
-			}
+	close(fd);
+
+	if (window > 0) { // streaming mode keeps the file mapped
+		open_stream();
+		resolve_symbols();
+		if (qry.active) bind_query();
+		return;
+	}
+
+	cache_key key = {buf_sz, (int64_t) info.st_mtim.tv_sec, (int64_t) info.st_mtim.tv_nsec,
+		trace_hash(buf, buf_sz)};
+	std::string cache_fname = fname + CACHE_SUFFIX;
+	bool cached = cache && load_cache(cache_fname, key);
+	if (!cached) {
+		if (is_binary_trace(buf, buf_sz)) load_binary(buf, buf_sz);
+		else load_text(buf, buf_sz);
+	}
+	if (buf) munmap((void*) buf, buf_sz);
+	buf = nullptr;
+	if (!cached) resolve_symbols();
+	if (qry.active) apply_query();
+	else if (cached) return;
+
+	build_xref();
+	build_lk_hist();
+
+#ifndef NDEBUG // validate lk_hist
+	for (size_t o = 0; o < objs.size(); ++o)
+		for (size_t k = lk_begin[o]; k < lk_begin[o+1]; ++k) {
+			assert(store.obj[lk_hist[k]] == o && "Object hist mismatch!");
+			assert((k == lk_begin[o] || store.ts[lk_hist[k-1]] <= store.ts[lk_hist[k]])
+					&& "Object hist not ordered!");
 		}
-		if (tid == 0) break; // all histories have been consumed
+#endif
+	if (cache && !cached && !qry.active) save_cache(cache_fname, key);
+}
+
+parser::~parser() {
+	if (buf) munmap((void*) buf, buf_sz);
+	if (cache_buf) munmap((void*) cache_buf, cache_sz);
+}
+
+// x / y to two decimals
+void put_ratio (std::ostream& outs, size_t x, size_t y) {
+	size_t r = (y == 0) ? 0 : (size_t) ((unsigned __int128) x * 100 / y);
+	outs << r / 100 << '.' << (char) ('0' + r / 10 % 10) << (char) ('0' + r % 10);
+}
+
+// record the name of addr while loading
+void parser::add_symbol (size_t addr, std::string_view name) {
+	sym_index.emplace(addr, std::make_pair(sym_arena.size(), name.size()));
+	sym_arena.append(name);
+}
+
+// point caller names and thread hooks into the finished symbol arena
+void parser::resolve_symbols () {
+	auto sym = [this] (size_t addr) {
+		auto it = sym_index.find(addr);
+		if (it == sym_index.end()) return std::string_view();
+		return std::string_view(sym_arena.data() + it->second.first, it->second.second);
+	};
+	caller_names.reserve(callers.size());
+	for (size_t c : callers) caller_names.push_back(sym(c));
 
-		// add to global hist
-		log_entry_ref R = {tid, *ind};
-		global_hist.push_back(R);
-		++(*ind); // increment index
+	// cross-reference thread hooks
+	thrd_hooks.reserve(thrds.size());
+	for (thrd_info& T : thrds) {
+		assert(sym_index.find(T.hook) != sym_index.end());
+		thrd_hooks.push_back(sym(T.hook));
 	}
+	std::unordered_map<size_t, std::pair<size_t, size_t> >().swap(sym_index);
+}
 
-#ifndef NDEBUG // validate global_hist
-	for (auto& e: global_hist) {
-		static size_t prev_ts = 0;
-		assert(get_ref(e).ts >= prev_ts && "Global hist not ordered!");
-		prev_ts = get_ref(e).ts;
+// first object seen with each caller
+void parser::build_xref () {
+	caller_xref.assign(callers.size(), UINT32_MAX);
+	for (size_t i = 0; i < store.size(); ++i)
+		if (caller_xref[store.caller[i]] == UINT32_MAX)
+			caller_xref[store.caller[i]] = store.obj[i];
+}
+
+// merge sort the per-thread histories by timestamp, ascending, into global_hist
+// this is a k-way merge over a binary min-heap of the threads' next entries,
+// keyed by (timestamp, dense thread index) so ties resolve in thread order
+// the global history costs a word per event, so it is only built on first use
+void parser::build_global () {
+	if (global_hist.size() == store.size()) return;
+	if (cache_global) { // loaded from the cache
+		global_hist.assign(cache_global, cache_global + store.size());
+		return;
 	}
-	size_t global_ev_count = 0;
-	for (auto& h: thrd_hist) {
-		global_ev_count += h.second.size();
+	struct head {
+		size_t ts;
+		size_t thrd; // dense index
+		bool operator< (const head& h) const {
+			return ts < h.ts || (ts == h.ts && thrd < h.thrd);
+		}
+	};
+	std::vector<size_t> pos; // next entry of each thread
+	std::vector<head> heap;
+	for (size_t t = 0; t < thrds.size(); ++t) {
+		if (thrds[t].begin < thrds[t].end)
+			heap.push_back({store.ts[thrds[t].begin], t});
+		pos.push_back(thrds[t].begin);
 	}
-	assert(global_ev_count == global_hist.size() && "Events missing from global hist!");
+	global_hist.reserve(store.size());
+
+	// restore the heap property from the root down
+	auto sift_down = [&heap] () {
+		size_t i = 0;
+		head h = heap[0];
+		while (1) {
+			size_t c = 2*i + 1;
+			if (c >= heap.size()) break;
+			if (c + 1 < heap.size() && heap[c+1] < heap[c]) ++c;
+			if (!(heap[c] < h)) break;
+			heap[i] = heap[c];
+			i = c;
+		}
+		heap[i] = h;
+	};
+	std::make_heap(heap.begin(), heap.end(),
+		[] (const head& a, const head& b) {return b < a;});
+
+	while (!heap.empty()) {
+		size_t t = heap[0].thrd;
+		global_hist.push_back(pos[t]);
+		if (++pos[t] < thrds[t].end) {
+			// replace the top with this thread's next entry
+			heap[0].ts = store.ts[pos[t]];
+		} else {
+			heap[0] = heap.back();
+			heap.pop_back();
+			if (heap.empty()) break;
+		}
+		sift_down();
+	}
+
+#ifndef NDEBUG // validate global_hist
+	for (size_t i = 1; i < global_hist.size(); ++i)
+		assert(store.ts[global_hist[i-1]] <= store.ts[global_hist[i]]
+				&& "Global hist not ordered!");
+	assert(store.size() == global_hist.size() && "Events missing from global hist!");
 #endif
+}
 
-	// cross-reference thread hooks
-	for (auto hist_v : thrd_hist) {
-		auto it = caller_names.find(hist_v.second.front().obj);
-		assert(it != caller_names.end());
-		// map tid to hook
-		// TODO: use hook addr instead
-		thrd_hooks.insert(std::make_pair(hist_v.first, it->second));
+// group the store by object id into lk_hist, in global order
+// this is a counting sort: the store is split into chunks that count their
+// objects in parallel, then scatter to their own offsets in parallel; each
+// object's history is then merged by (timestamp, store index), which orders
+// ties like global_hist since threads are laid out in order
+void parser::build_lk_hist () {
+	size_t n = store.size();
+	size_t n_objs = objs.size();
+	// per-chunk counts cost n_objs each, so keep chunks much larger than that
+	size_t chunks = std::max<size_t>(1,
+		std::min<size_t>(worker_count(), n / (4 * (n_objs + 1))));
+	size_t chunk_sz = (n + chunks - 1) / chunks;
+	std::vector<std::vector<size_t> > offs (chunks, std::vector<size_t>(n_objs, 0));
+	parallel_for(chunks, [&] (size_t c) {
+		size_t end = std::min(n, (c + 1) * chunk_sz);
+		for (size_t i = c * chunk_sz; i < end; ++i) ++offs[c][store.obj[i]];
+	});
+
+	// turn counts into each chunk's starting offset for each object
+	lk_begin.resize(n_objs + 1);
+	size_t off = 0;
+	for (size_t o = 0; o < n_objs; ++o) {
+		lk_begin[o] = off;
+		for (size_t c = 0; c < chunks; ++c) {
+			size_t count = offs[c][o];
+			offs[c][o] = off;
+			off += count;
+		}
 	}
+	lk_begin[n_objs] = off;
+
+	lk_hist.resize(n);
+	parallel_for(chunks, [&] (size_t c) {
+		size_t end = std::min(n, (c + 1) * chunk_sz);
+		for (size_t i = c * chunk_sz; i < end; ++i) lk_hist[offs[c][store.obj[i]]++] = i;
+	});
+	std::vector<std::vector<size_t> >().swap(offs);
+
+	// each object's history is a run per thread, in thread order;
+	// merge the runs pairwise
+	auto less = [this] (size_t a, size_t b) {
+		return store.ts[a] < store.ts[b] || (store.ts[a] == store.ts[b] && a < b);
+	};
+	parallel_for(n_objs, [&] (size_t o) {
+		std::vector<size_t> runs; // run starts
+		for (size_t k = lk_begin[o]; k < lk_begin[o+1]; ++k)
+			if (k == lk_begin[o] || store.thrd[lk_hist[k]] != store.thrd[lk_hist[k-1]])
+				runs.push_back(k);
+		runs.push_back(lk_begin[o+1]);
+		auto H = lk_hist.begin();
+		for (size_t w = 1; w + 1 < runs.size(); w *= 2)
+			for (size_t r = 0; r + w + 1 < runs.size(); r += 2*w)
+				std::inplace_merge(H + runs[r], H + runs[r+w],
+					H + runs[std::min(r + 2*w, runs.size() - 1)], less);
+	});
 }
-	
+
 // find all unique critical section patterns
+// patterns are sequences of lock acquires and releases (with their callers)
+// between quiescent points, where the thread holds no locks
 void parser::find_patterns () {
-	for (auto h : thrd_hist) {
-		size_t tid = h.first;
-		std::vector<log_entry>& hist = h.second;
-		// we represent patterns as strings of chars cast from event codes
-		// and then differentiate between patterns based on lock object addrs
-		std::unordered_multimap<std::u16string,
-			std::pair<std::vector<size_t>, size_t> > pat_map;
-		std::vector<size_t> caller_list;
-
-		std::u16string pat; // pattern of events
-		int lk_count = 0; // number of currently held locks
-		for (log_entry& e : hist) {
-			if (e.ev == event::LOCK_ACQ || e.ev == event::LOCK_REL) {
-
-				// add this caller to caller list
-				caller_list.push_back(e.caller);
-
-				switch (e.ev) {
-				case (event::LOCK_ACQ):
-					++lk_count;
-					pat += (char16_t) e.ev;
-
-					break;
-				case (event::LOCK_REL):
-					--lk_count;
-					pat += (char16_t) e.ev;	
-					if (lk_count == 0) { // quiescent point
-						// record pattern + caller set
-						auto range = pat_map.equal_range(pat);
-						while (range.first != range.second) {
-						if (range.first->second.first == caller_list) {
-							++(range.first->second.second);
-							caller_list.clear();
-							break;
-						}
-						++range.first;
-						}
-
-						if (!caller_list.empty())  // not found in map
-							pat_map.insert(std::make_pair(
-								pat, std::make_pair(
-								std::move(caller_list), 1)));
-						// reset pattern
-						pat.clear();
-					}
-					break;
-				default:
-					break;
-				}
-			}
+	lk_patterns.resize(thrds.size());
+	parallel_for(thrds.size(), [&] (size_t t) {
+		quiescent_scanner Q;
+		for (size_t i = thrds[t].begin; i < thrds[t].end; ++i) {
+			if (!Q.add(store.ev[i], store.caller[i])) continue;
+			count_pattern(lk_patterns[t], Q.pattern, Q.hash);
+			Q.reset();
 		}
-		// record patterns for this thread
-		lk_patterns.insert(std::make_pair(tid, std::move(pat_map))); // clears pat_map
-	}
+	});
+}
+
+// count an occurrence of pattern (which hashes to hash) in P
+void parser::count_pattern (thrd_patterns& P, const std::vector<pat_elem>& pattern,
+		uint64_t hash) {
+	uint32_t id = P.table.intern(pattern.data(), pattern.size(), hash);
+	if (id == P.counts.size()) P.counts.push_back(0);
+	++P.counts[id];
 }
 
 void parser::dump_patterns_txt (std::ostream& outs, size_t min_depth) {
-	for (auto pat_v : lk_patterns) {
-		size_t tid = pat_v.first;
-		auto pat_map = pat_v.second;
+	for (size_t t = 0; t < lk_patterns.size(); ++t) {
+		const thrd_patterns& P = lk_patterns[t];
 
 		outs << "=====\n";
-		outs << "Thread 0x" << std::hex << tid << " (hook=" << thrd_hooks.at(tid)
-		       << "):\n";	
-
-		for (auto pat: pat_map) {
-			const std::u16string& sig = pat.first;
-			if (sig.size()/2 >= min_depth) {
-				std::vector<size_t>& caller_addrs = pat.second.first;
-				for (size_t a = 0; a < sig.size(); ++a) {
-
-					outs << ev_to_descr((event) sig[a]) <<
-						" [0x" << std::hex << caller_xref[caller_addrs[a]]
-						<< "] @" << caller_names[caller_addrs[a]]; 
+		dump_thread_header(outs, t);
+
+		for (uint32_t id = 0; id < P.table.size(); ++id) {
+			const pat_elem* sig = P.table.seq(id);
+			size_t len = P.table.len(id);
+			if (len/2 >= min_depth) {
+				for (size_t a = 0; a < len; ++a) {
+
+					outs << ev_to_descr(sig[a].ev) <<
+						" [0x" << std::hex << objs[caller_xref[sig[a].caller]]
+						<< "] @" << caller_names[sig[a].caller]; 
 					//if (b != sig.size()-1) outs << " >";
 					outs << '\n';
 				}
-				outs << " occurs " << std::dec << pat.second.second << " time(s).\n\n";
+				outs << " occurs " << std::dec << P.counts[id] << " time(s).\n\n";
 			}
 		}
 		outs << '\n';
@@ -212,75 +279,69 @@ void parser::dump_patterns_txt (std::ostream& outs, size_t min_depth) {
 }
 
 void parser::dump_threads(std::ostream& outs) {
-	for (auto it = thrd_hist.begin(); it != thrd_hist.end(); ++it) {
-		size_t tid = it->first;
-		auto hist = it->second;
-		std::string& hook = thrd_hooks.at(tid);
-		//std::string hook = "<optimized out>";
-
+	for (size_t t = 0; t < thrds.size(); ++t) {
 		outs << "=====\n";
-		outs << "Thread 0x" << std::hex << tid << " (hook=" << hook << "):\n";
-		for (log_entry& L : hist) {
-			outs << ev_to_descr(L.ev) << " 0x" << L.obj
-				<< " in " << caller_names[L.caller] 
-				<< " [0x" << L.caller << "]\n";
-		}
+		dump_thread_header(outs, t);
+		for (size_t i = thrds[t].begin; i < thrds[t].end; ++i) dump_event(outs, store, i);
 		outs << '\n';
 	}
 }
 
 void parser::dump_patterns(std::ostream& outs) {
 
-for (auto& P : patterns) {
-	assert(P.first.size() % 2 == 0);
-	unsigned pat_len = P.first.size()/2;
+for (uint32_t id = 0; id < patterns.size(); ++id) {
+	const pattern_data& P = patterns[id];
+	const pat_elem* sig = pat_table.seq(id);
+	size_t pat_len = pat_table.len(id);
 	unsigned short depth = 0;
 	bool waiting = false;
 
-	for (unsigned i = 0; i < pat_len; ++i) {
-		event ev = (event) P.first[i];
-		size_t caller = id_caller[(size_t) P.first[i+pat_len]];
+	for (size_t i = 0; i < pat_len; ++i) {
+		event ev = sig[i].ev;
+		uint32_t caller_id = sig[i].caller;
+		size_t caller = callers[caller_id];
+		size_t obj = objs[caller_xref[caller_id]];
 		std::stringstream msg;
 
 		switch (ev) {
 		case (event::LOCK_ACQ):
 			assert(!waiting);
 			++depth;
-			msg << "Lock 0x" << std::hex << caller_xref[caller] << ": " <<
-				caller_names[caller] << " [0x" << caller << ']';
+			msg << "Lock 0x" << std::hex << obj << ": " <<
+				caller_names[caller_id] << " [0x" << caller << ']';
 			break;
 		case (event::LOCK_REL):
 			assert(depth > 0);
 			assert(!waiting);
 			--depth;
-			msg << "Unlock 0x" << std::hex << caller_xref[caller] << ": " <<
-				caller_names[caller] << " [0x" << caller << ']';
+			msg << "Unlock 0x" << std::hex << obj << ": " <<
+				caller_names[caller_id] << " [0x" << caller << ']';
 			break;
 		case (event::COND_WAIT):
 			assert(depth > 0);
 			assert(!waiting);
 			waiting = true;
-			msg << "Cond Wait 0x" << std::hex << caller_xref[caller] << ": "
-				<< caller_names[caller] << " [0x" << caller << ']';
+			msg << "Cond Wait 0x" << std::hex << obj << ": "
+				<< caller_names[caller_id] << " [0x" << caller << ']';
 			break;
 		case (event::COND_LEAVE):
 			assert(depth > 0);
 			assert(waiting);
 			waiting = false;
-			msg << "Cond Wake 0x" << std::hex << caller_xref[caller] << ": "
-				<< caller_names[caller] << " [0x" << caller << ']';
+			msg << "Cond Wake 0x" << std::hex << obj << ": "
+				<< caller_names[caller_id] << " [0x" << caller << ']';
 			break;
 		case (event::COND_SIGNAL):
 			assert(depth > 0);
 			assert(!waiting);
-			msg << "Cond Sig 0x" << std::hex << caller_xref[caller] << ": " <<
-				caller_names[caller] << " [0x" << caller << ']';
+			msg << "Cond Sig 0x" << std::hex << obj << ": " <<
+				caller_names[caller_id] << " [0x" << caller << ']';
 			break;
 		case (event::COND_BRDCST):
 			assert(depth > 0);
 			assert(!waiting);
-			msg << "Cond Brd 0x" << std::hex << caller_xref[caller] << ": " <<
-				caller_names[caller] << " [0x" << caller << ']';
+			msg << "Cond Brd 0x" << std::hex << obj << ": " <<
+				caller_names[caller_id] << " [0x" << caller << ']';
 			break;
 		default:
 			assert(false && "Incorrect event in pattern!");
@@ -300,158 +361,95 @@ for (auto& P : patterns) {
 			outs << '\n';
 	}
 	
-	for (auto& I : P.second.instances) {
+	for (auto& I : P.instances) {
 		outs << std::dec << I.second << " occurrences in thread 0x" << std::hex <<
-			I.first << " [" << thrd_hooks[I.first] << "]\n";
+			thrds[I.first].tid << " [" << thrd_hooks[I.first] << "]\n";
 	}
 	outs << "Mean time in pattern: " <<
-		(double) P.second.total_time / (double) P.second.instances.size()
+		(double) P.total_time / (double) P.instances.size()
 		<< " ticks\n\n";
 }
 
 }
 
 void parser::dump_global(std::ostream& outs) {
-	for (auto it = global_hist.begin(); it != global_hist.end(); ++it) {
-		log_entry& L = thrd_hist[it->tid][it->ind];
-		outs << std::hex << "0x" << it->tid << '\t' << ev_code_to_str(L.ev)
-			<< "\t0x" << L.obj << '\t' << caller_names[L.caller] << '\t'
-			<< std::dec << L.ts << '\n';
-	}
+	build_global();
+	for (size_t i : global_hist) dump_global_event(outs, store, i);
 }
 
-inline char16_t parser::get_caller_id (size_t caller) {
-	auto c_it = caller_id.find(caller);
-	if (c_it == caller_id.end()) {
-		assert(id_caller.size() < (1 << 16));
-		auto emplit = caller_id.emplace(std::make_pair(caller,
-					(char16_t) id_caller.size()));
-		assert(emplit.second);
-		c_it = emplit.first;
-		id_caller.push_back(caller);
-	}
-	return c_it->second;
+// heading of thread t's section in dump_threads() and dump_patterns_txt()
+void parser::dump_thread_header (std::ostream& outs, size_t t) {
+	outs << "Thread 0x" << std::hex << thrds[t].tid << " (hook=" << thrd_hooks[t] << ")";
+	if (!thrd_pids.empty()) outs << " in process " << std::dec << thrd_pids[t] << std::hex;
+	outs << ":\n";
 }
 
-void parser::find_deps (size_t min_depth) {
-	size_t holder_tid = 0;
-	size_t init_time = 0;
-	bool skip_wait_unlock = false;
-	unsigned depth = 0;
-	auto next = global_hist.end();
-	std::u16string pattern;
-	std::u16string callers;
-	// records timestamp of last commit for a tid
-	// used to avoid recording inner patterns multiple times
-	// while still properly uninterleaving
-	std::unordered_map<size_t, size_t> last_commit;
-
-	// walk global hist, uninterleaving and finding per-thread patterns
-	for (auto Rit = global_hist.begin(); Rit != global_hist.end(); ++Rit ) {
-
-	const log_entry_ref& R = *Rit;
-	const log_entry& L = get_ref(R);
-
-	switch (L.ev) {
-	
-	case (event::LOCK_ACQ):
-		if (R.tid == holder_tid) { // relevant event
-			if (!skip_wait_unlock) {
-				++depth;
-				pattern += (char16_t) L.ev;
-				callers += get_caller_id(L.caller);
-			} else {
-				assert(pattern.back() == (char16_t) event::COND_LEAVE);
-				skip_wait_unlock = false;
-			}
-		} else if (depth == 0) { // not in pattern, start new one
-			// acq does not start a new pattern if it ocurred before
-			// the end of the last pattern in this thread
-			if (L.ts > last_commit[R.tid]) {
-				assert(!skip_wait_unlock);
-				holder_tid = R.tid;
-				init_time = L.ts;
-				++depth;
-				pattern += (char16_t) L.ev;
-				callers += get_caller_id(L.caller);
-			}
-		} else if (next == global_hist.end()) { 
-			// this acq marks the beginning of a new pattern if it occurs
-			// after the end of the last commit for that thread
-			// (or that thread has never committed)
-			if (L.ts > last_commit[R.tid])
-				next = Rit;
-		}
-		break;
-	case (event::LOCK_REL):
-		if (R.tid == holder_tid) {
-
-
-		if (!skip_wait_unlock) {
-
-		pattern += (char16_t) L.ev;
-		callers += get_caller_id(L.caller);
+// line of event i of S in dump_threads()
+void parser::dump_event (std::ostream& outs, const event_store& S, size_t i) {
+	uint32_t caller_id = S.caller[i];
+	outs << ev_to_descr(S.ev[i]) << " 0x" << std::hex << objs[S.obj[i]]
+		<< " in " << caller_names[caller_id]
+		<< " [0x" << callers[caller_id] << "]\n";
+}
 
-		if (depth == 1) { // end of pattern, commit and reset
-			assert(pattern.size() == callers.size());
-			if (pattern.size()/2 >= min_depth) {
-				pattern += callers;
-				pattern_data& pdat = patterns[pattern];
-				pdat.instance(holder_tid);
-				pdat.total_time += (L.ts - init_time);
-			}
-			// do not record any more patterns for this tid
-			// with a timestamp less than this one
-			last_commit[holder_tid] = L.ts;
-
-			// reset info
-			pattern.clear();
-			callers.clear();
-			init_time = 0;
-			holder_tid = 0;
-
-			// go back to the beginning of the next interleaved CS
-			// if one was noted
-			if (next != global_hist.end()) {
-				Rit = next;
-				--Rit; // loop will re-increment
-				next = global_hist.end();
-			}
+// line of event i of S in dump_global()
+void parser::dump_global_event (std::ostream& outs, const event_store& S, size_t i) {
+	// threads of different processes may share a tid
+	if (!thrd_pids.empty()) outs << std::dec << thrd_pids[S.thrd[i]] << '/';
+	outs << std::hex << "0x" << thrds[S.thrd[i]].tid << '\t'
+		<< ev_code_to_str(S.ev[i]) << "\t0x" << objs[S.obj[i]] << '\t'
+		<< caller_names[S.caller[i]] << '\t'
+		<< std::dec << S.ts[i] << '\n';
+}
 
+// find the critical sections of each thread and aggregate them into patterns
+// (see section_scanner)
+// threads are scanned independently in one pass each, in parallel, into
+// their own pattern tables, which are then merged into pat_table
+void parser::find_deps (size_t min_depth) {
+	std::vector<thrd_sections> thrd_pats (thrds.size());
+
+	parallel_for(thrds.size(), [&] (size_t t) {
+		section_scanner S;
+		size_t dur;
+		for (size_t R = thrds[t].begin; R < thrds[t].end; ++R) {
+			if (!S.add(store.ev[R], store.caller[R], store.ts[R], dur)) continue;
+			if (S.pattern.size()/2 >= min_depth) count_section(thrd_pats[t], S, dur);
+			S.reset();
 		}
+	});
+	merge_deps(thrd_pats);
+}
 
-		--depth;
-		} else { // skip_wait_unlock = true
-			assert(pattern[pattern.size()-1] == (char16_t) event::COND_WAIT);
-		}
-		} // R.tid == holder_tid
-		
-		break;
-	case (event::COND_WAIT):
-		if (R.tid == holder_tid) {
-			skip_wait_unlock = true;
-			pattern += (char16_t) L.ev;
-			callers += get_caller_id(L.caller);
-		}
-		break;
-	case (event::COND_LEAVE):
-		if (R.tid == holder_tid) {
-			pattern += (char16_t) L.ev;
-			callers += get_caller_id(L.caller);
-		}
-		break;
-	case (event::COND_SIGNAL):
-	case (event::COND_BRDCST):
-		if (R.tid == holder_tid) {
-			pattern += (char16_t) L.ev;
-			callers += get_caller_id(L.caller);
+// count a section of S's pattern, which lasted dur ticks, in P
+void parser::count_section (thrd_sections& P, const section_scanner& S, size_t dur) {
+	uint32_t id = P.table.intern(S.pattern.data(), S.pattern.size(), S.hash);
+	if (id == P.stats.size()) P.stats.emplace_back(0, 0);
+	++P.stats[id].first;
+	P.stats[id].second += dur;
+}
+
+// merge the per-thread sections into patterns in thread order, reusing the
+// per-thread hashes, so the patterns and their threads are listed the same
+// in streaming mode
+void parser::merge_deps (std::vector<thrd_sections>& thrd_pats) {
+	for (size_t t = 0; t < thrds.size(); ++t) {
+		thrd_sections& P = thrd_pats[t];
+		for (uint32_t id = 0; id < P.table.size(); ++id) {
+			pattern_data& pdat = add_pattern(P.table.seq(id), P.table.len(id),
+					P.table.hash(id));
+			pdat.instances.push_back(std::make_pair(t, P.stats[id].first));
+			pdat.total_time += P.stats[id].second;
 		}
-		break;
-	default:
-		break;
+		P = thrd_sections();
 	}
-	} // for
+}
 
+// the pattern_data of a critical section pattern, added if new
+pattern_data& parser::add_pattern (const pat_elem* seq, size_t len, uint64_t hash) {
+	uint32_t id = pat_table.intern(seq, len, hash);
+	if (id == patterns.size()) patterns.emplace_back();
+	return patterns[id];
 }
 
 } // namespace lktrace
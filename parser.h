@@ -2,53 +2,49 @@
 #include <vector>
 #include <unordered_map>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <iostream>
 #include <limits>
 #include <functional>
+#include <tuple>
+#include <memory>
+#include <array>
 
 #include <cassert>
 
 #include "event.h"
 #include "enum_ops.h"
+#include "tracefmt.h"
+#include "store.h"
+#include "pattern.h"
+#include "scan.h"
+#include "query.h"
+#include "parallel.h"
 
 namespace lktrace {
 
-// parsed log entry struct
-struct log_entry {
-	event ev; // event code
-	size_t ts; // timestamp
-	size_t obj; // address of sync object
-	size_t caller; // address of caller
+// per-thread address numbering used while decoding (see loader.cpp)
+struct local_ids;
 
-	bool operator== (const log_entry& p) const {
-		return (ev == p.ev && ts == p.ts && obj == p.obj && caller == p.caller);
-	}
-};
-
-// reference to a log entry
-// we use this rather than a more compact iterator or ptr because the
-// context often needs the tid as well
-struct log_entry_ref {
+// per-thread info
+struct thrd_info {
 	size_t tid;
-	size_t ind;
-
-	bool operator== (const log_entry_ref& p) const {
-		return tid == p.tid && ind == p.ind;
-	}
-
-	operator bool () const {
-		return tid != 0;
-	}
+	size_t hook; // address of thread hook
+	// range of this thread's events in the event_store
+	size_t begin;
+	size_t end;
+};
 
-	static log_entry_ref null () {
-		log_entry_ref N = {0, 0};
-		return N;
-	}
+// node of the calling context tree of a trace recorded with stacks
+// (see tracefmt.h)
+struct cct_node {
+	uint32_t parent;
+	uint32_t caller; // caller id of the frame
 };
 
 struct pattern_data {
-	// tid of threads where the pattern occurs,
+	// dense index of threads where the pattern occurs,
 	// and count of occurrences
 	std::vector<std::pair<size_t, size_t>> instances;
 
@@ -66,54 +62,459 @@ struct pattern_data {
 	size_t wait_time;
 };
 
+// per-thread pattern occurrences (see find_patterns())
+struct thrd_patterns {
+	pattern_table table;
+	std::vector<size_t> counts; // by pattern id
+};
+
+// per-thread critical section patterns (see find_deps())
+struct thrd_sections {
+	pattern_table table;
+	std::vector<std::pair<size_t, size_t> > stats; // count, total time by id
+};
+
+// contention statistics of a lock (see find_locks())
+// times are in ticks
+struct lock_stats {
+	uint32_t obj; // object id
+	size_t acqs; // acquisitions
+	size_t contended; // acquisitions that waited longer than the threshold
+	size_t total_wait;
+	size_t total_hold;
+	// p50, p90, p99 and max of the wait (request to acquire)
+	// and hold (acquire to release) times
+	size_t wait_pct[4];
+	size_t hold_pct[4];
+	// callers of contended acquisitions (caller id, count, total wait),
+	// most waited first
+	std::vector<std::tuple<uint32_t, size_t, size_t> > callsites;
+};
+
+// lock wait time charged to one callsite holding a lock, in one critical
+// section pattern (see find_blame()); times are in ticks
+struct blame_stats {
+	uint32_t obj; // object id
+	uint32_t caller; // caller id of the acquire
+	uint32_t pattern; // section pattern id, in blame_pats
+	size_t ticks; // total wait charged
+	size_t holds; // holds that kept a thread waiting
+	size_t waits; // waits they overlapped (one per hold and thread)
+	size_t max; // charged to a single hold
+};
+
+// step of a thread's critical path (see find_critical_path()): a thread
+// running, or waiting for a lock or condvar, over [begin, end) ticks
+// a wait is that of thrd, for object obj at callsite caller; a thread other
+// than the traced one running is charged to the wait the path reached it by,
+// in obj and caller (UINT32_MAX for the traced thread's own execution)
+struct path_seg {
+	enum kind_t : uint8_t {RUN, LOCK_WAIT, COND_WAIT};
+	kind_t kind;
+	uint32_t thrd;
+	uint32_t obj;
+	uint32_t caller;
+	size_t begin;
+	size_t end;
+};
+
+// critical path of a thread over a time window, latest step first
+struct crit_path {
+	uint32_t thrd = UINT32_MAX; // dense index (UINT32_MAX if not in the trace)
+	bool ambiguous = false; // the thread id is in several merged processes
+	size_t begin = 0;
+	size_t end = 0;
+	std::vector<path_seg> segs;
+};
+
+// wait and wake statistics of a condvar (see find_condvars())
+// times are in ticks
+struct cond_stats {
+	uint32_t obj; // object id
+	uint32_t mutex; // object id of the mutex its waits release (UINT32_MAX if none)
+	size_t waits;
+	size_t signals;
+	size_t brdcsts;
+	// waits left after a signal or broadcast, with none (spurious), or
+	// by error (eg. timed out)
+	size_t by_signal;
+	size_t by_brdcst;
+	size_t spurious;
+	size_t failed;
+	// signals and broadcasts with no thread waiting
+	size_t lost_signals;
+	size_t lost_brdcsts;
+	// p50, p90, p99 and max of signal to wake (the return from the wait,
+	// with the mutex reacquired)
+	size_t wake_total;
+	size_t wake_pct[4];
+	size_t blocked; // wakes with the mutex held by another thread since the signal
+	size_t rewaits; // wakes followed by another wait before releasing the mutex
+	// the same, for wakes by a broadcast
+	size_t herd_blocked;
+	size_t herd_rewaits;
+};
+
+// convoys and handoff fairness of a lock (see find_convoys())
+// times are in ticks
+struct convoy_stats {
+	uint32_t obj; // object id
+	size_t span; // first to last event of the lock
+	size_t convoys;
+	size_t convoy_time;
+	// longest convoy: duration, acquisitions and threads
+	size_t longest;
+	size_t longest_acqs;
+	size_t longest_thrds;
+	// releases with threads waiting, by who got the lock next
+	size_t handoffs;
+	size_t in_order;
+	size_t out_of_order;
+	size_t barged;
+	size_t barged_self;
+	size_t to_cond; // to a thread leaving a condvar wait (not in handoffs)
+	// the threads waiting longest (dense index, waits, longest wait, most
+	// times overtaken in one wait), longest first
+	std::vector<std::tuple<uint32_t, size_t, size_t, size_t> > starved;
+};
+
+// waiters on a lock over time (see find_queue_depth()); times are in ticks
+struct queue_stats {
+	uint32_t obj; // object id
+	size_t span; // first to last event of the lock
+	size_t max; // most waiters at once
+	size_t area; // waiter-ticks, so the mean depth is area / span
+	size_t held; // ticks held by some thread
+	size_t bins[QUEUE_BINS]; // ticks at each depth
+	// timeline (see parser::tl_begin): waiter-ticks, ticks held and most
+	// waiters in each bucket
+	std::vector<size_t> b_area;
+	std::vector<size_t> b_held;
+	std::vector<uint32_t> b_max;
+};
+
+// the threads running one thread hook, by state over their lifetimes (see
+// find_utilization()); times are in ticks
+struct util_stats {
+	uint64_t pid; // process (merged traces only)
+	std::string_view hook;
+	size_t first, last; // first spawn to last exit
+	size_t ticks[UTIL_STATES]; // thread-ticks in each state
+	// its threads (dense index, ticks in each state), in trace order
+	std::vector<std::pair<uint32_t, std::array<size_t, UTIL_STATES> > > thrds;
+	// timeline (see parser::tl_begin): thread-ticks in each state in each
+	// bucket
+	std::vector<size_t> b_ticks[UTIL_STATES];
+};
+
+// the locks on a cache line (see find_false_sharing()); times are in ticks
+struct line_stats {
+	uint32_t proc; // trace of its locks (merged traces with per-process objects)
+	size_t addr; // of the line
+	// lock events while another thread held another lock on the line, and
+	// the time it was held by threads on different locks
+	size_t conflicts;
+	size_t shared;
+	size_t wait; // total of its locks
+	// its locks (object id, acquisitions, contended acquisitions, total wait),
+	// most waited first
+	std::vector<std::tuple<uint32_t, size_t, size_t, size_t> > locks;
+};
+
+// cpu migration of a lock (see find_migration()), by cpu_dist from the
+// cpu of the lock's last release to that of each acquisition after it
+// times are in ticks
+struct migration_stats {
+	uint32_t obj; // object id
+	size_t acqs; // all acquisitions, including those with no distance
+	size_t handoffs[CPU_DISTS];
+	size_t from_other[CPU_DISTS]; // released by another thread
+	// holds started by those acquisitions, and their total time
+	size_t holds[CPU_DISTS];
+	size_t hold_total[CPU_DISTS];
+};
+
+// fill a lock_stats with the results of a finished lock_scanner
+void lock_result(lock_scanner&, lock_stats&);
+
+// get the (decompressed if necessary) payload of a trace block (see loader.cpp)
+const char* block_payload(const char*, const index_entry&, std::string&, const char*&);
+
+// write x / y to two decimals (see parser.cpp)
+void put_ratio(std::ostream&, size_t, size_t);
+
+// samples kept exactly per time distribution in streaming mode (see time_dist)
+#define STREAM_SAMPLES 1024
+
+// sidecar cache of a loaded trace, named after it (see cache.cpp)
+#define CACHE_SUFFIX ".lkc"
+
+// identifies the trace a cache was made from
+struct cache_key {
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t hash; // see trace_hash()
+};
+
+uint64_t trace_hash(const char*, size_t);
+
 class parser {
 
-	// per-thread histories (key=tid)
-	// this stores the actual event objects, other orderings point here
-	std::unordered_map<size_t, std::vector<log_entry> > thrd_hist;
+	// all events, grouped by thread in history order
+	event_store store;
+
+	// threads, by dense index (in trace file order)
+	std::vector<thrd_info> thrds;
+	// key=tid (UINT32_MAX for a tid in several merged processes)
+	std::unordered_map<size_t, uint32_t> thrd_ind;
+	// pid of each thread's process, by dense index (merged traces only)
+	std::vector<uint64_t> thrd_pids;
+	// merged traces whose objects are identified per process (see
+	// parser(std::vector<...>&, bool)) only: the trace of each object, by
+	// id, and the pid of each trace
+	std::vector<uint32_t> obj_procs;
+	std::vector<uint64_t> proc_pids;
+
+	// object and caller addresses, by id
+	std::vector<size_t> objs;
+	std::vector<size_t> callers;
+
+	// per-object histories: indices into the store in global order, grouped
+	// by object id; object o's history is lk_hist[lk_begin[o], lk_begin[o+1])
+	std::vector<size_t> lk_hist;
+	std::vector<size_t> lk_begin;
+
+	// lock contention results, worst first
+	std::vector<lock_stats> lk_stats;
+
+	// flame graph stacks (see find_flame()): pid, thread hook, caller id (or
+	// calling context node, with stacks), object id and total ticks
+	std::vector<std::tuple<uint64_t, std::string_view, uint32_t, uint32_t, size_t> > flame;
+
+	// blocking callsites, most wait charged first, and the critical section
+	// patterns they were held in (see find_blame())
+	std::vector<blame_stats> blame;
+	pattern_table blame_pats;
+
+	// lock convoy results, most time in convoys first
+	std::vector<convoy_stats> lk_convoys;
+
+	// buckets of the timelines of --queue-depth and --utilization: tl_width
+	// ticks each, from tl_begin (see set_timeline())
+	size_t tl_begin = 0;
+	size_t tl_width = 1;
+
+	// queue depth of the locks that had waiters, most waiter-time first
+	std::vector<queue_stats> lk_queues;
+
+	// thread utilization per thread hook, most thread time first
+	std::vector<util_stats> util;
+
+	// cache lines holding locks, most waited first (see find_false_sharing())
+	std::vector<line_stats> lk_lines;
+
+	// lock migration results, most handoffs across nodes first
+	std::vector<migration_stats> migration;
+
+	// condvar results, most time to wake first
+	std::vector<cond_stats> cv_stats;
+
+	// critical path of the thread chosen for find_critical_path()
+	crit_path path;
 
-	// per-lock histories (key=lock addr)
-	std::unordered_map<size_t, std::vector<log_entry_ref> > lk_hist;
+	// critical section patterns (see find_deps())
+	pattern_table pat_table;
+	std::vector<pattern_data> patterns; // by pattern id
 
-	std::unordered_map<std::u16string, pattern_data> patterns;
-	std::unordered_map<size_t, char16_t> caller_id;
-	std::vector<size_t> id_caller;
+	// globally ordered history (indices into the store)
+	// only built when needed (see build_global())
+	std::vector<size_t> global_hist;
 
-	// globally ordered history
-	std::vector<log_entry_ref> global_hist;
+	// resolved names of addresses, stored back to back
+	std::string sym_arena;
+	// key=in-memory addr, value=offset and length in sym_arena
+	// only used while loading
+	std::unordered_map<size_t, std::pair<size_t, size_t> > sym_index;
 
 	// symbol names of thread hooks (or filenames if symbol name was not found)
-	// key=tid
-	std::unordered_map<size_t, std::string> thrd_hooks;
+	// by dense thread index
+	std::vector<std::string_view> thrd_hooks;
 
-	// resolved names of caller addresses
-	// key=in-memory addr
-	std::unordered_map<size_t, std::string> caller_names;
+	// resolved names of callers (empty if not found), by caller id
+	std::vector<std::string_view> caller_names;
 
-	// corresponding object addrs for caller addresses
-	std::unordered_map<size_t, size_t> caller_xref;
+	// corresponding object id for each caller id
+	std::vector<uint32_t> caller_xref;
+
+	// calling context tree, by node id (empty if the trace has no stacks)
+	// event i's stack runs from node store.ctx[i] up to the root, node 0
+	std::vector<cct_node> cct;
+
+	// cpu topology, by cpu id (empty if the trace has no cpu ids)
+	std::vector<cpu_topo> topo;
 	
-	// locking pattern results per-thread
-	// key=tid -> key = pattern signature -> caller list + count
-	std::unordered_map<size_t, std::unordered_multimap<
-		std::u16string, std::pair<std::vector<size_t>, size_t> > > lk_patterns;
+	// locking pattern results per-thread, by dense thread index
+	std::vector<thrd_patterns> lk_patterns;
+
+	// header of the trace file (zeroed for text traces)
+	file_header hdr;
+
+	// binary trace index, and the blocks of each thread (by dense index)
+	// kept in streaming mode, where events are decoded from the file as needed
+	std::vector<index_entry> index;
+	std::vector<std::vector<const index_entry*> > thrd_blocks;
+
+	// streaming mode: events buffered per thread (0 = load the whole trace)
+	size_t window;
+	// the mapped trace file (streaming mode)
+	const char* buf;
+	size_t buf_sz;
+
+	// event filter (see query.h), and whether each object and caller
+	// id passes it
+	query qry;
+	std::vector<char> qry_obj;
+	std::vector<char> qry_caller;
+
+	// the mapped cache the trace was loaded from, if any, and the
+	// global order in it
+	const char* cache_buf;
+	size_t cache_sz;
+	const size_t* cache_global;
+
+	// ticks to ns, by the trace's calibration (text traces tick in ns)
+	size_t to_ns (size_t t) const {
+		if (hdr.tick_num == 0) return t;
+		return (size_t) ((unsigned __int128) t * hdr.tick_num * 1000000000ull / hdr.tick_den);
+	}
 
-	const log_entry& get_ref (log_entry_ref R) const {
-		return (thrd_hist.at(R.tid))[R.ind];
+	// the process of object o after its address, in merged traces where
+	// objects are per process; leaves outs in decimal
+	void put_obj_pid (std::ostream& outs, uint32_t o) const {
+		outs << std::dec;
+		if (!obj_procs.empty()) outs << " (process " << proc_pids[obj_procs[o]] << ')';
 	}
 
-	char16_t get_caller_id (size_t);
+	// caller ids of the frames of calling context node n, innermost first
+	void ctx_frames (uint32_t n, std::vector<uint32_t>& out) const {
+		out.clear();
+		for (; n != 0; n = cct[n].parent) out.push_back(cct[n].caller);
+	}
+
+	void read_index(const char*, size_t);
+	void select_blocks(const std::vector<uint64_t>&);
+	void bind_query();
+	// first and last timestamp of the events analyzed (from the block index
+	// in streaming mode)
+	void time_span(size_t&, size_t&) const;
+	// split the time span into the given number of timeline buckets
+	void set_timeline(size_t);
+	bool query_match(const event_store& S, size_t i) const {
+		return qry.match_time(S.ts[i]) && qry.match_ev(S.ev[i]) && qry_obj[S.obj[i]]
+			&& qry_caller[S.caller[i]];
+	}
+	void apply_query();
+	void open_stream();
+	void load_binary(const char*, size_t);
+	void load_text(const char*, size_t);
+	void merge_ids(std::vector<local_ids>&);
+	bool load_cache(const std::string&, const cache_key&);
+	void save_cache(const std::string&, const cache_key&);
+	template <class F> void cache_sections(F,
+			std::vector<std::pair<uint64_t, uint64_t> >&);
+	void add_symbol(size_t, std::string_view);
+	void resolve_symbols();
+	void build_xref();
+	void build_global();
+	void build_lk_hist();
+
+	void count_pattern(thrd_patterns&, const std::vector<pat_elem>&, uint64_t);
+	void count_section(thrd_sections&, const section_scanner&, size_t);
+	void merge_deps(std::vector<thrd_sections>&);
+	pattern_data& add_pattern(const pat_elem*, size_t, uint64_t);
+	void rank_locks();
+	void merge_flame(std::vector<flame_scanner>&);
+	void merge_utilization(std::vector<util_scanner>&);
+
+	void dump_thread_header(std::ostream&, size_t);
+	void dump_event(std::ostream&, const event_store&, size_t);
+	void dump_global_event(std::ostream&, const event_store&, size_t);
+	template <class F> void stream_merge(F);
+	void scan_global(const std::function<void (const event_store&, size_t)>&);
+
+	// call f(o, S, i) for each lock event of each object o, in the object's
+	// history order: objects in parallel from their histories, or all in
+	// one merged pass in streaming mode; f may keep state per object
+	template <class F> void scan_locks (F f) {
+		if (window > 0) {
+			scan_global([&] (const event_store& S, size_t i) {
+				if (is_lock_event(S.ev[i])) f(S.obj[i], S, i);
+			});
+			return;
+		}
+		parallel_for(objs.size(), [&] (size_t o) {
+			for (size_t k = lk_begin[o]; k < lk_begin[o+1]; ++k)
+				if (is_lock_event(store.ev[lk_hist[k]])) f((uint32_t) o, store, lk_hist[k]);
+		});
+	}
 
 	public:
-	parser(std::string);
+	// a whole trace is loaded from its cache if it has a valid one, and
+	// the cache is written otherwise (unless cache is false)
+	// only the events matching q are loaded, and such a partial load is
+	// not cached
+	parser(std::string, size_t window = 0, bool cache = true, const query& q = query());
+	// merge traces loaded by load_all() into one (see multi.cpp)
+	// objects are per process unless shared is set, which identifies them by
+	// address across processes
+	parser(std::vector<std::unique_ptr<parser> >&, bool shared = false);
+	~parser();
+
+	// load several traces in parallel, aligned on a shared clock base
+	static std::vector<std::unique_ptr<parser> > load_all(
+			const std::vector<std::string>&, bool cache = true, const query& q = query());
+	uint64_t pid () const {return hdr.pid;}
 
 	void dump_threads(std::ostream&);
 	void dump_patterns(std::ostream&);
 	void dump_patterns_txt(std::ostream&, size_t);
 	void dump_global(std::ostream&);
+	void dump_locks(std::ostream&);
+	void export_chrome(std::ostream&, size_t budget);
+	void dump_flame(std::ostream&);
+	void dump_blame(std::ostream&);
+	void dump_critical_path(std::ostream&);
+	void dump_condvars(std::ostream&);
+	void dump_convoys(std::ostream&);
+	void dump_migration(std::ostream&);
+	void dump_false_sharing(std::ostream&);
+	void dump_queue_depth(std::ostream&);
+	void dump_queue_csv(std::ostream&);
+	void dump_utilization(std::ostream&);
+	void dump_utilization_csv(std::ostream&);
 
 	void find_patterns();
 	void find_deps(size_t);
+	void find_locks(size_t);
+	void find_flame(bool hold);
+	void find_blame();
+	void find_critical_path(const query&);
+	void find_condvars();
+	void find_convoys(size_t);
+	void find_migration();
+	void find_false_sharing(size_t);
+	void find_queue_depth(size_t buckets);
+	void find_utilization(size_t buckets);
+
+	// streaming mode versions of the above
+	// the find_*() analyses selected by the flags run in one merged pass
+	void stream_threads(std::ostream&);
+	void stream_global(std::ostream&);
+	void stream_flame(bool hold);
+	void stream_utilization(size_t buckets);
+	void stream_find(bool deps, bool pats, bool locks, size_t min_depth,
+			size_t threshold);
 };
 
 } // namespace lktrace
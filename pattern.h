@@ -0,0 +1,88 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+
+#include "event.h"
+
+namespace lktrace {
+
+// one step of a pattern: an event and the id of its caller
+struct pat_elem {
+	event ev;
+	uint32_t caller;
+
+	bool operator== (const pat_elem& p) const {
+		return ev == p.ev && caller == p.caller;
+	}
+};
+
+// interned pattern table
+// each distinct sequence of pat_elems gets a dense pattern id, in order of
+// first appearance; sequences are stored back to back in one arena and
+// found through an open addressing table keyed by their hash
+//
+// hashes are built incrementally with hash_step() as a sequence is
+// extended, so interning a finished sequence costs one lookup
+class pattern_table {
+	struct entry {
+		size_t off; // into arena
+		uint32_t len;
+		uint64_t hash;
+	};
+	std::vector<pat_elem> arena;
+	std::vector<entry> entries; // by pattern id
+	std::vector<uint32_t> slots; // pattern id + 1, 0 = empty
+
+	// insert id in the first free slot of its probe sequence
+	void place (uint32_t id) {
+		size_t mask = slots.size() - 1;
+		size_t s = entries[id].hash & mask;
+		while (slots[s] != 0) s = (s + 1) & mask;
+		slots[s] = id + 1;
+	}
+
+	void grow () {
+		slots.assign((slots.empty()) ? 64 : slots.size() * 2, 0);
+		for (uint32_t id = 0; id < entries.size(); ++id) place(id);
+	}
+
+	public:
+	static constexpr uint64_t HASH_INIT = 0xcbf29ce484222325;
+
+	static uint64_t hash_step (uint64_t h, pat_elem e) {
+		h ^= ((uint64_t) e.ev << 32) | e.caller;
+		h *= 0x100000001b3;
+		return h ^ (h >> 29);
+	}
+
+	// get the id of seq[0, len), which hashes to h, adding it if new
+	uint32_t intern (const pat_elem* seq, size_t len, uint64_t h) {
+		if (2 * (entries.size() + 1) > slots.size()) grow();
+		size_t mask = slots.size() - 1;
+		for (size_t s = h & mask; slots[s] != 0; s = (s + 1) & mask) {
+			const entry& E = entries[slots[s] - 1];
+			if (E.hash != h || E.len != len) continue;
+			size_t i = 0;
+			while (i < len && arena[E.off + i] == seq[i]) ++i;
+			if (i == len) return slots[s] - 1;
+		}
+		assert(entries.size() < UINT32_MAX && len < UINT32_MAX);
+		uint32_t id = (uint32_t) entries.size();
+		entries.push_back({arena.size(), (uint32_t) len, h});
+		arena.insert(arena.end(), seq, seq + len);
+		place(id);
+		return id;
+	}
+
+	// number of patterns
+	size_t size () const {return entries.size();}
+
+	// the sequence of pattern id, valid until the next intern()
+	const pat_elem* seq (uint32_t id) const {return arena.data() + entries[id].off;}
+	size_t len (uint32_t id) const {return entries[id].len;}
+	uint64_t hash (uint32_t id) const {return entries[id].hash;}
+};
+
+} // namespace lktrace
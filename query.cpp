@@ -0,0 +1,111 @@
+// event filtering for lkdump --where (see query.h)
+// binary traces are filtered first by block, using the index and lock-set
+// block, so blocks that cannot match are never decoded; the events that
+// remain are then filtered one by one
+#include "parser.h"
+#include "parallel.h"
+
+#include <algorithm> // any_of()
+
+namespace lktrace {
+
+// drop the thread blocks that cannot hold matching events, by their thread,
+// time range and lock set
+// a block that repeats events of the block before it (old traces, without
+// BLK_INDEP) keeps that block too, and every thread keeps at least one
+// block, since its hook is in the block header
+void parser::select_blocks (const std::vector<uint64_t>& locksets) {
+	qry.to_ticks(hdr);
+
+	// lock sets are by thread block, in index order
+	std::vector<size_t> ord (index.size(), 0);
+	size_t n = 0;
+	for (size_t k = 0; k < index.size(); ++k)
+		if (index[k].type == block_type::THREAD) ord[k] = n++;
+	bool by_lock = !qry.locks.empty() && locksets.size() == n * LOCKSET_WORDS;
+	std::vector<uint64_t> lock_ids;
+	if (by_lock)
+		for (size_t o = 0; o < objs.size(); ++o)
+			if (qry.match_lock(objs[o])) lock_ids.push_back(o);
+
+	std::vector<std::vector<const index_entry*> > selected;
+	for (auto& blocks : thrd_blocks) {
+		if (!qry.match_tid(blocks.front()->tid)) continue;
+		std::vector<char> keep (blocks.size(), 0);
+		for (size_t k = 0; k < blocks.size(); ++k) {
+			const index_entry& I = *blocks[k];
+			keep[k] = I.t_max >= qry.t_lo && I.t_min <= qry.t_hi;
+			if (keep[k] && by_lock) {
+				const uint64_t* set = &locksets[ord[&I - index.data()] * LOCKSET_WORDS];
+				keep[k] = std::any_of(lock_ids.begin(), lock_ids.end(),
+					[set] (uint64_t id) {return lockset_test(set, id);});
+			}
+		}
+		for (size_t k = blocks.size(); k-- > 1;)
+			if (keep[k] && !(blocks[k]->flags & BLK_INDEP)) keep[k-1] = 1;
+		if (std::find(keep.begin(), keep.end(), 1) == keep.end()) keep[0] = 1;
+
+		selected.emplace_back();
+		for (size_t k = 0; k < blocks.size(); ++k)
+			if (keep[k]) selected.back().push_back(blocks[k]);
+	}
+	thrd_blocks.swap(selected);
+}
+
+// evaluate the query's lock and caller terms for each object and caller id
+void parser::bind_query () {
+	qry.to_ticks(hdr);
+	qry_obj.resize(objs.size());
+	for (size_t o = 0; o < objs.size(); ++o) qry_obj[o] = qry.match_lock(objs[o]);
+	qry_caller.resize(callers.size());
+	for (size_t c = 0; c < callers.size(); ++c)
+		qry_caller[c] = qry.match_caller(caller_names[c]);
+}
+
+// drop the events that do not match the query, and the threads it excludes
+void parser::apply_query () {
+	bind_query();
+	// the cached global order is of the whole trace
+	cache_global = nullptr;
+
+	// filter each thread's events in place
+	std::vector<size_t> kept (thrds.size(), 0);
+	parallel_for(thrds.size(), [&] (size_t t) {
+		if (!qry.match_tid(thrds[t].tid)) return;
+		size_t j = thrds[t].begin;
+		for (size_t i = thrds[t].begin; i < thrds[t].end; ++i) {
+			if (!query_match(store, i)) continue;
+			store.copy(j++, i);
+		}
+		kept[t] = j - thrds[t].begin;
+	});
+
+	// then close the gaps between threads, renumbering them
+	size_t at = 0;
+	uint32_t n = 0;
+	thrd_ind.clear();
+	for (size_t t = 0; t < thrds.size(); ++t) {
+		if (!qry.match_tid(thrds[t].tid)) continue;
+		size_t b = thrds[t].begin, e = b + kept[t];
+		std::copy(store.ts.begin() + b, store.ts.begin() + e, store.ts.begin() + at);
+		std::copy(store.ev.begin() + b, store.ev.begin() + e, store.ev.begin() + at);
+		std::copy(store.obj.begin() + b, store.obj.begin() + e, store.obj.begin() + at);
+		std::copy(store.caller.begin() + b, store.caller.begin() + e,
+			store.caller.begin() + at);
+		if (store.with_ctx)
+			std::copy(store.ctx.begin() + b, store.ctx.begin() + e, store.ctx.begin() + at);
+		if (store.with_cpu)
+			std::copy(store.cpu.begin() + b, store.cpu.begin() + e, store.cpu.begin() + at);
+		std::fill(store.thrd.begin() + at, store.thrd.begin() + at + kept[t], n);
+		thrds[n] = {thrds[t].tid, thrds[t].hook, at, at + kept[t]};
+		thrd_hooks[n] = thrd_hooks[t];
+		thrd_ind.emplace(thrds[n].tid, n);
+		at += kept[t];
+		++n;
+	}
+	thrds.resize(n);
+	thrd_hooks.resize(n);
+	store.resize(at);
+}
+
+} // namespace lktrace
@@ -0,0 +1,206 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <fnmatch.h>
+
+#include "event.h"
+#include "tracefmt.h"
+
+// event filter of lkdump --where
+// a query is a conjunction of terms separated by "&&":
+//	t<T, t<=T, t>T, t>=T	time since the trace start, in ticks or with a
+//				unit (ns, us, ms or s)
+//	thread=TID		thread id
+//	lock=ADDR		sync object (lock or condvar) address
+//	caller=GLOB		callsite symbol name, as an fnmatch() pattern
+//	event=CODE		event code, as in the global dump (eg. LA)
+// a term may list alternatives separated by '|' (eg. event=LQ|LA)
+// the parser skips trace blocks that cannot match (see parser::select_blocks()),
+// then drops the remaining events that do not (see parser::apply_query())
+
+namespace lktrace {
+
+struct query {
+	bool active = false;
+	// time range, inclusive; bounds given with a unit are in ns until bound
+	// to a trace's clock by to_ticks()
+	size_t t_lo = 0;
+	size_t t_hi = SIZE_MAX;
+	bool lo_ns = false;
+	bool hi_ns = false;
+	std::vector<size_t> tids;
+	std::vector<size_t> locks;
+	std::vector<std::string> callers;
+	bool ev_ok[256]; // by pack_ev() code
+	bool any_ev = true;
+
+	query () {std::fill(ev_ok, ev_ok + 256, true);}
+
+	// parse the query in str; returns false (with a message in err)
+	// if it is malformed
+	bool parse (std::string_view str, std::string& err) {
+		active = true;
+		while (!str.empty()) {
+			size_t amp = str.find("&&");
+			std::string_view term = trim(str.substr(0, amp));
+			str = (amp == std::string_view::npos) ? std::string_view() : str.substr(amp + 2);
+			size_t op = term.find_first_of("<>=");
+			if (op == std::string_view::npos || op == 0) {
+				err = "expected <key><op><value> in '" + std::string(term) + "'";
+				return false;
+			}
+			std::string_view key = trim(term.substr(0, op));
+			size_t op_len = (op + 1 < term.size() && term[op+1] == '=') ? 2 : 1;
+			std::string_view cmp = term.substr(op, op_len);
+			std::string_view val = trim(term.substr(op + op_len));
+			if (val.empty()) {
+				err = "missing value in '" + std::string(term) + "'";
+				return false;
+			}
+			if (key == "t") {
+				if (!parse_time(cmp, val, err)) return false;
+				continue;
+			}
+			if (cmp != "=") {
+				err = "only '=' applies to " + std::string(key);
+				return false;
+			}
+			if (key == "event") {
+				any_ev = false;
+				std::fill(ev_ok, ev_ok + 256, false);
+			}
+			while (!val.empty()) { // alternatives
+				size_t bar = val.find('|');
+				std::string v (trim(val.substr(0, bar)));
+				val = (bar == std::string_view::npos) ? std::string_view() : val.substr(bar + 1);
+				if (key == "thread" || key == "lock") {
+					char* end;
+					size_t a = strtoull(v.c_str(), &end, 0);
+					if (v.empty() || *end) {
+						err = "bad address '" + v + "'";
+						return false;
+					}
+					((key == "thread") ? tids : locks).push_back(a);
+				} else if (key == "caller") {
+					callers.push_back(v);
+				} else if (key == "event") {
+					event ev = event::NULL_EVENT;
+					for (event e : {event::LOCK_REQ, event::LOCK_ACQ, event::LOCK_REL,
+							event::LOCK_ERR, event::COND_WAIT, event::COND_LEAVE,
+							event::COND_SIGNAL, event::COND_BRDCST, event::COND_ERR,
+							event::THRD_SPAWN, event::THRD_EXIT})
+						if (ev_code_to_str(e) == v) ev = e;
+					if (ev == event::NULL_EVENT) {
+						err = "unknown event code '" + v + "'";
+						return false;
+					}
+					ev_ok[pack_ev(ev)] = true;
+				} else {
+					err = "unknown key '" + std::string(key) + "'";
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	// convert bounds given in ns to ticks of a trace with header hdr
+	// (text traces have no clock calibration, and are taken to tick in ns)
+	void to_ticks (const file_header& hdr) {
+		auto conv = [&hdr] (size_t& v, bool& ns) {
+			if (!ns || hdr.tick_num == 0) {
+				ns = false;
+				return;
+			}
+			unsigned __int128 t = (unsigned __int128) v * hdr.tick_den
+				/ (hdr.tick_num * 1000000000ull);
+			v = (t > SIZE_MAX) ? SIZE_MAX : (size_t) t;
+			ns = false;
+		};
+		if (t_hi != SIZE_MAX) conv(t_hi, hi_ns);
+		conv(t_lo, lo_ns);
+	}
+
+	// move the time range to a trace whose timestamps will be shifted
+	// later by shift ticks (see parser::load_all())
+	void shift (size_t s) {
+		if (t_hi != SIZE_MAX && t_hi < s) { // all before the trace
+			t_lo = 1;
+			t_hi = 0;
+			return;
+		}
+		t_lo = (t_lo > s) ? t_lo - s : 0;
+		if (t_hi != SIZE_MAX) t_hi -= s;
+	}
+
+	bool match_time (size_t ts) const {return ts >= t_lo && ts <= t_hi;}
+	bool match_ev (event ev) const {return ev_ok[pack_ev(ev)];}
+	bool match_caller (std::string_view name) const {
+		if (callers.empty()) return true;
+		std::string s (name);
+		for (const std::string& g : callers)
+			if (fnmatch(g.c_str(), s.c_str(), 0) == 0) return true;
+		return false;
+	}
+	bool match_tid (size_t tid) const {
+		return tids.empty() || std::find(tids.begin(), tids.end(), tid) != tids.end();
+	}
+	bool match_lock (size_t addr) const {
+		return locks.empty() || std::find(locks.begin(), locks.end(), addr) != locks.end();
+	}
+
+	private:
+	static std::string_view trim (std::string_view s) {
+		while (!s.empty() && isspace((unsigned char) s.front())) s.remove_prefix(1);
+		while (!s.empty() && isspace((unsigned char) s.back())) s.remove_suffix(1);
+		return s;
+	}
+
+	bool parse_time (std::string_view cmp, std::string_view val, std::string& err) {
+		std::string v (val);
+		char* end;
+		double t = strtod(v.c_str(), &end);
+		std::string unit = end;
+		double scale = 1;
+		bool ns = true;
+		if (unit == "s") scale = 1e9;
+		else if (unit == "ms") scale = 1e6;
+		else if (unit == "us") scale = 1e3;
+		else if (unit == "ns") scale = 1;
+		else if (unit.empty()) ns = false;
+		else {
+			err = "bad time '" + v + "'";
+			return false;
+		}
+		if (end == v.c_str() || t < 0) {
+			err = "bad time '" + v + "'";
+			return false;
+		}
+		size_t x = (size_t) (t * scale + 0.5);
+		if (cmp == ">") ++x;
+		if (cmp == "<") {
+			if (x == 0) { // nothing is before the start
+				t_lo = 1;
+				t_hi = 0;
+				return true;
+			}
+			--x;
+		}
+		if ((cmp[0] == '>' || cmp == "=") && x >= t_lo) {
+			t_lo = x;
+			lo_ns = ns;
+		}
+		if ((cmp[0] == '<' || cmp == "=") && x <= t_hi) {
+			t_hi = x;
+			hi_ns = ns;
+		}
+		return true;
+	}
+};
+
+} // namespace lktrace
@@ -0,0 +1,96 @@
+// queue depth of each lock over time: the number of threads waiting for it
+// and whether it is held, as exact step functions of time (see
+// depth_scanner), summarized as the most and mean waiters and a
+// time-weighted histogram of the depth, or as a timeline of buckets
+#include "parser.h"
+
+#include <memory> // unique_ptr
+#include <algorithm> // sort()
+
+namespace lktrace {
+
+namespace {
+
+// fill S with the results of a finished depth scanner
+void queue_result (depth_scanner& D, queue_stats& S) {
+	S.span = (D.first == SIZE_MAX) ? 0 : D.last - D.first;
+	S.max = D.max;
+	S.area = D.area;
+	S.held = D.held;
+	std::copy(D.bins, D.bins + QUEUE_BINS, S.bins);
+	S.b_area.swap(D.b_area);
+	S.b_held.swap(D.b_held);
+	S.b_max.swap(D.b_max);
+}
+
+} // namespace
+
+// compute queue_stats for every lock that had waiters, on a timeline of
+// the given number of buckets over the trace
+void parser::find_queue_depth (size_t buckets) {
+	lk_queues.clear();
+	buckets = std::max<size_t>(buckets, 1);
+	set_timeline(buckets);
+	std::vector<queue_stats> Q (objs.size());
+	std::vector<std::unique_ptr<depth_scanner> > D (objs.size());
+	scan_locks([&] (uint32_t o, const event_store& E, size_t i) {
+		if (!D[o]) D[o].reset(new depth_scanner(tl_begin, tl_width, buckets));
+		D[o]->add(E.ev[i], E.thrd[i], E.ts[i]);
+	});
+	for (size_t o = 0; o < objs.size(); ++o) {
+		Q[o].obj = (uint32_t) o;
+		Q[o].max = 0;
+		if (D[o]) queue_result(*D[o], Q[o]);
+	}
+
+	for (queue_stats& S : Q)
+		if (S.max > 0) lk_queues.push_back(std::move(S));
+	std::sort(lk_queues.begin(), lk_queues.end(), [] (const queue_stats& a, const queue_stats& b) {
+		if (a.area != b.area) return a.area > b.area;
+		if (a.max != b.max) return a.max > b.max;
+		return a.obj < b.obj;
+	});
+}
+
+void parser::dump_queue_depth (std::ostream& outs) {
+	for (const queue_stats& S : lk_queues) {
+		outs << "Lock 0x" << std::hex << objs[S.obj];
+		put_obj_pid(outs, S.obj);
+		outs << ": at most " << S.max
+			<< " thread(s) waiting, ";
+		put_ratio(outs, S.area, S.span);
+		outs << " on average over " << to_ns(S.span) << " ns, held ";
+		outs << ((S.span > 0) ? S.held * 100 / S.span : 0) << "% of the time\n";
+		outs << "\ttime at each depth:";
+		const char* sep = " ";
+		for (size_t d = 0; d < QUEUE_BINS; ++d) {
+			if (S.bins[d] == 0) continue;
+			outs << sep << d << ((d == QUEUE_BINS - 1) ? "+" : "") << ": ";
+			put_ratio(outs, S.bins[d] * 100, S.span);
+			outs << '%';
+			sep = ", ";
+		}
+		outs << "\n\n";
+	}
+}
+
+// one row per lock and bucket: the bucket's start and end (ns), the mean
+// and most waiters in it, and the percentage of it the lock was held
+// locks of merged traces with per-process objects are pid/address, as in
+// the global dump
+void parser::dump_queue_csv (std::ostream& outs) {
+	outs << "lock,begin_ns,end_ns,mean_waiters,max_waiters,held_pct\n";
+	for (const queue_stats& S : lk_queues)
+		for (size_t k = 0; k < S.b_max.size(); ++k) {
+			size_t b = tl_begin + k * tl_width;
+			if (!obj_procs.empty()) outs << std::dec << proc_pids[obj_procs[S.obj]] << '/';
+			outs << "0x" << std::hex << objs[S.obj] << std::dec << ',' << to_ns(b) << ','
+				<< to_ns(b + tl_width) << ',';
+			put_ratio(outs, S.b_area[k], tl_width);
+			outs << ',' << S.b_max[k] << ',';
+			put_ratio(outs, S.b_held[k] * 100, tl_width);
+			outs << '\n';
+		}
+}
+
+} // namespace lktrace
@@ -0,0 +1,1012 @@
+#pragma once
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+
+#include "event.h"
+#include "pattern.h"
+#include "tracefmt.h" // cpu_topo
+
+// incremental scanners behind the parser's analyses
+// each one is fed the events of one thread or lock in time order, so the
+// same code serves the in-memory analyses and the streaming mode
+
+namespace lktrace {
+
+// mutex events (requests, acquires, releases and failed trylocks)
+inline bool is_lock_event (event ev) {
+	return ev == event::LOCK_REQ || ev == event::LOCK_ACQ || ev == event::LOCK_REL
+		|| ev == event::LOCK_ERR;
+}
+
+// critical sections of a thread (see parser::find_deps())
+// a section runs from the outermost acquire to the release that brings the
+// lock depth back to 0, and includes the lock and condvar events in between
+struct section_scanner {
+	std::vector<pat_elem> pattern;
+	uint64_t hash = pattern_table::HASH_INIT;
+	size_t init_time = 0;
+	unsigned depth = 0;
+	// between a condvar wait and the wake, the mutex release and
+	// reacquire inside pthread_cond_wait() are not part of the pattern
+	bool skip_wait_unlock = false;
+
+	void append (event ev, uint32_t caller) {
+		pat_elem e = {ev, caller};
+		pattern.push_back(e);
+		hash = pattern_table::hash_step(hash, e);
+	}
+
+	// feed the next event; returns true if it ends a section, which is then
+	// left in pattern and hash (with its duration in dur) until reset()
+	bool add (event ev, uint32_t caller, size_t ts, size_t& dur) {
+		switch (ev) {
+		case (event::LOCK_ACQ):
+			if (depth == 0) { // start of a section
+				assert(!skip_wait_unlock);
+				init_time = ts;
+			} else if (skip_wait_unlock) {
+				assert(pattern.back().ev == event::COND_LEAVE);
+				skip_wait_unlock = false;
+				break;
+			}
+			++depth;
+			append(ev, caller);
+			break;
+		case (event::LOCK_REL):
+			if (depth == 0) break;
+			if (skip_wait_unlock) {
+				assert(pattern.back().ev == event::COND_WAIT);
+				break;
+			}
+			append(ev, caller);
+			if (--depth == 0) {
+				dur = ts - init_time;
+				return true;
+			}
+			break;
+		case (event::COND_WAIT):
+			if (depth == 0) break;
+			skip_wait_unlock = true;
+			append(ev, caller);
+			break;
+		case (event::COND_LEAVE):
+		case (event::COND_SIGNAL):
+		case (event::COND_BRDCST):
+			if (depth == 0) break;
+			append(ev, caller);
+			break;
+		default:
+			break;
+		}
+		return false;
+	}
+
+	void reset () {
+		pattern.clear();
+		hash = pattern_table::HASH_INIT;
+	}
+};
+
+// lock acquire/release sequences of a thread between quiescent points,
+// where it holds no locks (see parser::find_patterns())
+struct quiescent_scanner {
+	std::vector<pat_elem> pattern;
+	uint64_t hash = pattern_table::HASH_INIT;
+	int lk_count = 0; // number of currently held locks
+
+	// feed the next event; returns true at a quiescent point, with the
+	// pattern left in pattern and hash until reset()
+	bool add (event ev, uint32_t caller) {
+		if (ev != event::LOCK_ACQ && ev != event::LOCK_REL) return false;
+		pat_elem e = {ev, caller};
+		pattern.push_back(e);
+		hash = pattern_table::hash_step(hash, e);
+		lk_count += (ev == event::LOCK_ACQ) ? 1 : -1;
+		return ev == event::LOCK_REL && lk_count == 0;
+	}
+
+	void reset () {
+		pattern.clear();
+		hash = pattern_table::HASH_INIT;
+	}
+};
+
+// distribution of times
+// samples are kept exactly until there are cap of them, then folded into a
+// log-linear histogram (32 buckets per power of 2, so percentiles are
+// within about 3%)
+class time_dist {
+	size_t cap;
+	std::vector<size_t> samples;
+	std::vector<size_t> buckets;
+	size_t max = 0;
+
+	static size_t bucket (size_t v) {
+		if (v < 32) return v;
+		unsigned e = 63 - __builtin_clzll(v);
+		return (e - 4) * 32 + ((v >> (e - 5)) & 31);
+	}
+
+	// midpoint of bucket b
+	static size_t value (size_t b) {
+		if (b < 32) return b;
+		unsigned e = b / 32 + 4;
+		size_t lo = (32 + b % 32) << (e - 5);
+		return lo + ((size_t) 1 << (e - 5)) / 2;
+	}
+
+	void fold (size_t v) {
+		size_t b = bucket(v);
+		if (b >= buckets.size()) buckets.resize(b + 1, 0);
+		++buckets[b];
+	}
+
+	public:
+	time_dist (size_t cap = SIZE_MAX) : cap(cap) {}
+
+	void add (size_t v) {
+		max = std::max(max, v);
+		if (buckets.empty() && samples.size() < cap) {
+			samples.push_back(v);
+			return;
+		}
+		for (size_t s : samples) fold(s);
+		std::vector<size_t>().swap(samples);
+		fold(v);
+	}
+
+	// p50, p90, p99 (nearest rank) and max into out
+	void percentiles (size_t* out) {
+		const size_t pct[] = {50, 90, 99};
+		std::fill(out, out + 4, 0);
+		if (!buckets.empty()) {
+			size_t n = 0;
+			for (size_t c : buckets) n += c;
+			size_t b = 0, seen = 0;
+			for (int k = 0; k < 3; ++k) {
+				size_t rank = (n * pct[k] + 99) / 100;
+				while (seen + buckets[b] < rank) seen += buckets[b++];
+				out[k] = std::min(value(b), max);
+			}
+		} else if (!samples.empty()) {
+			std::sort(samples.begin(), samples.end());
+			for (int k = 0; k < 3; ++k)
+				out[k] = samples[(samples.size() * pct[k] + 99) / 100 - 1];
+		}
+		out[3] = max;
+	}
+};
+
+// contention statistics of one lock (see parser::find_locks())
+// an acquisition is contended if it came more than threshold ticks after
+// the request; reacquiring a mutex on leaving a condvar wait has no request,
+// so it counts as an acquisition without a wait time
+struct lock_scanner {
+	size_t acqs = 0;
+	size_t contended = 0;
+	size_t total_wait = 0;
+	size_t total_hold = 0;
+	time_dist waits, holds;
+	// pending request and acquire times, key=dense thread index
+	std::unordered_map<uint32_t, size_t> req, acq;
+	// key=caller id, value=count, total wait
+	std::unordered_map<uint32_t, std::pair<size_t, size_t> > sites;
+
+	lock_scanner (size_t cap = SIZE_MAX) : waits(cap), holds(cap) {}
+
+	void add (event ev, uint32_t thrd, uint32_t caller, size_t ts, size_t threshold) {
+		switch (ev) {
+		case (event::LOCK_REQ):
+			req[thrd] = ts;
+			break;
+		case (event::LOCK_ERR): // failed trylock
+			req.erase(thrd);
+			break;
+		case (event::LOCK_ACQ): {
+			++acqs;
+			acq[thrd] = ts;
+			auto it = req.find(thrd);
+			if (it == req.end()) break;
+			size_t wait = ts - it->second;
+			req.erase(it);
+			waits.add(wait);
+			total_wait += wait;
+			if (wait > threshold) {
+				++contended;
+				auto& site = sites[caller];
+				++site.first;
+				site.second += wait;
+			}
+			break;
+		}
+		case (event::LOCK_REL): {
+			auto it = acq.find(thrd);
+			if (it == acq.end()) break;
+			size_t hold = ts - it->second;
+			acq.erase(it);
+			holds.add(hold);
+			total_hold += hold;
+			break;
+		}
+		default:
+			break;
+		}
+	}
+};
+
+// time one thread spends waiting for (request to acquire) or holding (acquire
+// to release) each lock, by site of the request or acquire: its caller id,
+// or its calling context node if the trace has stacks (see parser::find_flame())
+struct flame_scanner {
+	bool hold;
+	// pending requests or acquires (time and site), key=object id
+	std::unordered_map<uint32_t, std::pair<size_t, uint32_t> > open;
+	// total ticks, key=site << 32 | object id
+	std::unordered_map<uint64_t, size_t> ticks;
+
+	flame_scanner (bool hold) : hold(hold) {}
+
+	void add (event ev, uint32_t obj, uint32_t site, size_t ts) {
+		event begin = (hold) ? event::LOCK_ACQ : event::LOCK_REQ;
+		event end = (hold) ? event::LOCK_REL : event::LOCK_ACQ;
+		if (ev == begin) {
+			open[obj] = {ts, site};
+			return;
+		}
+		// a failed trylock ends a request without a wait
+		if (ev != end && (hold || ev != event::LOCK_ERR)) return;
+		auto it = open.find(obj);
+		if (it == open.end()) return;
+		if (ev == end)
+			ticks[(uint64_t) it->second.second << 32 | obj] += ts - it->second.first;
+		open.erase(it);
+	}
+};
+
+// timeline slices of the lock and condvar events (see parser::export_chrome())
+// fed the events of all threads in global order; a slice is a lock wait
+// (request to acquire), a lock hold (acquire to release), a condvar wait
+// (wait to wake) or a signal (an instant, begin == end)
+// a condvar wait is linked to the last signal or broadcast of its condvar
+// since the wait began, if any
+struct slice {
+	enum kind_t : uint8_t {LOCK_WAIT, LOCK_HOLD, COND_WAIT, COND_SIGNAL};
+	kind_t kind;
+	uint32_t thrd;
+	uint32_t obj;
+	uint32_t caller; // of the request, acquire, wait or signal
+	size_t begin;
+	size_t end;
+	// signal that ended a condvar wait (sig_thrd is UINT32_MAX if none)
+	uint32_t sig_thrd;
+	size_t sig_ts;
+};
+
+struct slice_scanner {
+	typedef std::unordered_map<uint64_t, std::pair<size_t, uint32_t> > pending_map;
+	// pending requests, acquires and condvar waits (time and caller),
+	// key=dense thread index << 32 | object id
+	pending_map req, acq, wait;
+	// number of them, key=dense thread index
+	std::unordered_map<uint32_t, uint32_t> open;
+	// last signal of each condvar (thread and time), key=object id
+	std::unordered_map<uint32_t, std::pair<uint32_t, size_t> > sig;
+
+	// whether thread thrd has no slice open, so every later slice of it
+	// begins after the ones so far
+	bool idle (uint32_t thrd) const {
+		auto it = open.find(thrd);
+		return it == open.end() || it->second == 0;
+	}
+
+	// feed the next event; returns true if it ends a slice, left in out
+	bool add (event ev, uint32_t thrd, uint32_t obj, uint32_t caller, size_t ts,
+			slice& out) {
+		uint64_t key = (uint64_t) thrd << 32 | obj;
+		out = {slice::LOCK_WAIT, thrd, obj, caller, ts, ts, UINT32_MAX, 0};
+		auto start = [&] (pending_map& m) {
+			if (m.insert_or_assign(key, std::make_pair(ts, caller)).second) ++open[thrd];
+		};
+		auto close = [&] (pending_map& m, slice::kind_t kind) {
+			auto it = m.find(key);
+			if (it == m.end()) return false;
+			out.kind = kind;
+			out.begin = it->second.first;
+			out.caller = it->second.second;
+			m.erase(it);
+			--open[thrd];
+			return true;
+		};
+		switch (ev) {
+		case (event::LOCK_REQ):
+			start(req);
+			break;
+		case (event::LOCK_ERR): // failed trylock
+			if (req.erase(key)) --open[thrd];
+			break;
+		case (event::LOCK_ACQ):
+			start(acq);
+			return close(req, slice::LOCK_WAIT);
+		case (event::LOCK_REL):
+			return close(acq, slice::LOCK_HOLD);
+		case (event::COND_WAIT):
+			start(wait);
+			break;
+		case (event::COND_LEAVE):
+		case (event::COND_ERR): {
+			if (!close(wait, slice::COND_WAIT)) break;
+			auto it = sig.find(obj);
+			if (ev == event::COND_LEAVE && it != sig.end()
+					&& it->second.second >= out.begin) {
+				out.sig_thrd = it->second.first;
+				out.sig_ts = it->second.second;
+			}
+			return true;
+		}
+		case (event::COND_SIGNAL):
+		case (event::COND_BRDCST):
+			sig[obj] = {thrd, ts};
+			out.kind = slice::COND_SIGNAL;
+			return true;
+		default:
+			break;
+		}
+		return false;
+	}
+};
+
+// lock wait time charged to the threads that held the lock meanwhile
+// (see parser::find_blame())
+// fed the events of all threads in global order; while a lock has both
+// waiters and holders, each holder is charged the time of every waiter but
+// itself, split evenly between the holders
+// a released hold is kept with its thread until the critical section around
+// it ends, so it can be reported with the section's pattern
+struct blame_scanner {
+	struct hold {
+		uint32_t thrd;
+		uint32_t obj;
+		uint32_t caller; // of the acquire
+		size_t ticks; // charged
+		std::vector<uint32_t> blocked; // threads kept waiting
+	};
+	struct lock_state {
+		std::vector<hold> holders;
+		std::vector<uint32_t> waiters;
+		size_t last = 0; // time of the lock's last event
+	};
+	struct thrd_state {
+		section_scanner section;
+		std::vector<hold> released; // in the open section
+	};
+	std::unordered_map<uint32_t, lock_state> locks;
+	std::vector<thrd_state> thrds; // by dense thread index
+
+	blame_scanner (size_t n_thrds) : thrds(n_thrds) {}
+
+	// charge L's holders for the time since its last event, up to ts
+	void charge (lock_state& L, size_t ts) {
+		size_t dt = ts - L.last;
+		L.last = ts;
+		if (dt == 0 || L.holders.empty() || L.waiters.empty()) return;
+		for (hold& h : L.holders)
+			for (uint32_t w : L.waiters) {
+				if (w == h.thrd) continue;
+				h.ticks += dt / L.holders.size();
+				if (std::find(h.blocked.begin(), h.blocked.end(), w) == h.blocked.end())
+					h.blocked.push_back(w);
+			}
+	}
+
+	// feed the next event; returns true if it ends a critical section of
+	// thread thrd, left in thrds[thrd] until reset(thrd)
+	bool add (event ev, uint32_t thrd, uint32_t obj, uint32_t caller, size_t ts) {
+		switch (ev) {
+		case (event::LOCK_REQ):
+		case (event::LOCK_ERR): // failed trylock
+		case (event::LOCK_ACQ): {
+			lock_state& L = locks[obj];
+			charge(L, ts);
+			auto w = std::find(L.waiters.begin(), L.waiters.end(), thrd);
+			if (w != L.waiters.end()) L.waiters.erase(w);
+			if (ev == event::LOCK_REQ) L.waiters.push_back(thrd);
+			if (ev == event::LOCK_ACQ) L.holders.push_back({thrd, obj, caller, 0, {}});
+			break;
+		}
+		case (event::LOCK_REL): {
+			lock_state& L = locks[obj];
+			charge(L, ts);
+			for (size_t k = L.holders.size(); k-- > 0;) {
+				if (L.holders[k].thrd != thrd) continue;
+				// a release outside any section has no pattern to report
+				if (L.holders[k].ticks > 0 && thrds[thrd].section.depth > 0)
+					thrds[thrd].released.push_back(std::move(L.holders[k]));
+				L.holders.erase(L.holders.begin() + k);
+				break;
+			}
+			break;
+		}
+		default:
+			break;
+		}
+		size_t dur;
+		return thrds[thrd].section.add(ev, caller, ts, dur);
+	}
+
+	void reset (uint32_t thrd) {
+		thrds[thrd].section.reset();
+		thrds[thrd].released.clear();
+	}
+};
+
+// condvar waits and wakes (see parser::find_condvars())
+// fed the events of all threads in global order; a signal with waiters
+// present leaves one wake, and a broadcast one per waiter, which the next
+// waiters to leave take in order, so a wait left with no wake pending is
+// spurious, and a signal or broadcast with no waiters is lost
+// the tracer records the wake and the reacquire of the mutex together, once
+// pthread_cond_wait() has returned with the mutex, so the reacquire cannot
+// be timed; instead, a woken thread was blocked on the mutex if another
+// thread held it between the signal and the wake; a thread that waits on
+// the condvar again before releasing the mutex woke for nothing
+struct cond_scanner {
+	struct cond_state {
+		uint32_t mutex = UINT32_MAX; // released by its waits (UINT32_MAX = none seen)
+		size_t waits = 0, signals = 0, brdcsts = 0;
+		size_t by_signal = 0, by_brdcst = 0, spurious = 0, failed = 0;
+		size_t lost_signals = 0, lost_brdcsts = 0;
+		size_t wake_total = 0, blocked = 0;
+		size_t rewaits = 0, herd_blocked = 0, herd_rewaits = 0;
+		time_dist wake; // signal to wake
+		std::vector<uint32_t> waiters;
+		// pending wakes (signal time, and whether it was a broadcast), oldest first
+		std::vector<std::pair<size_t, bool> > wakes;
+
+		cond_state (size_t cap) : wake(cap) {}
+	};
+	// a thread's last wake, until it releases the mutex or waits again
+	struct woken {
+		uint32_t cond = UINT32_MAX; // UINT32_MAX = none
+		bool brdcst;
+		bool reacquired;
+		uint32_t mutex;
+	};
+	// holders of a lock, and the time and thread of its last release
+	struct lock_state {
+		uint32_t holders = 0;
+		size_t rel_ts = 0;
+		uint32_t rel_thrd = UINT32_MAX;
+	};
+	size_t cap;
+	std::unordered_map<uint32_t, cond_state> conds;
+	std::unordered_map<uint32_t, lock_state> locks;
+	std::vector<uint32_t> waiting; // condvar each thread waits on (UINT32_MAX = none)
+	// mutex released by each thread's wait (UINT32_MAX = none)
+	std::vector<uint32_t> wait_mutex;
+	std::vector<woken> woke;
+
+	cond_scanner (size_t n_thrds, size_t cap = SIZE_MAX) :
+		cap(cap), waiting(n_thrds, UINT32_MAX), wait_mutex(n_thrds, UINT32_MAX),
+		woke(n_thrds) {}
+
+	cond_state& state (uint32_t obj) {
+		return conds.try_emplace(obj, cap).first->second;
+	}
+
+	// remove thread thrd from C's waiters, and the wakes no waiter can take
+	void leave (cond_state& C, uint32_t thrd) {
+		C.waiters.erase(std::find(C.waiters.begin(), C.waiters.end(), thrd));
+		waiting[thrd] = UINT32_MAX;
+		if (C.wakes.size() > C.waiters.size())
+			C.wakes.erase(C.wakes.begin(), C.wakes.end() - C.waiters.size());
+	}
+
+	void add (event ev, uint32_t thrd, uint32_t obj, size_t ts) {
+		woken& W = woke[thrd];
+		switch (ev) {
+		case (event::COND_WAIT): {
+			cond_state& C = state(obj);
+			if (W.cond == obj && W.reacquired) { // woke for nothing
+				++C.rewaits;
+				if (W.brdcst) ++C.herd_rewaits;
+			}
+			W.cond = UINT32_MAX;
+			++C.waits;
+			C.waiters.push_back(thrd);
+			waiting[thrd] = obj;
+			wait_mutex[thrd] = UINT32_MAX;
+			break;
+		}
+		case (event::COND_LEAVE):
+		case (event::COND_ERR): {
+			if (waiting[thrd] != obj) break;
+			cond_state& C = state(obj);
+			if (ev == event::COND_ERR) {
+				++C.failed;
+				leave(C, thrd);
+				break;
+			}
+			W = {obj, false, false, UINT32_MAX};
+			if (C.wakes.empty()) {
+				++C.spurious;
+			} else {
+				size_t sig = C.wakes.front().first, lat = ts - sig;
+				W.brdcst = C.wakes.front().second;
+				++((W.brdcst) ? C.by_brdcst : C.by_signal);
+				C.wake.add(lat);
+				C.wake_total += lat;
+				C.wakes.erase(C.wakes.begin());
+				// the mutex held by another thread since the signal
+				auto L = locks.find(wait_mutex[thrd]);
+				if (L != locks.end() && (L->second.holders > 0
+						|| (L->second.rel_ts >= sig && L->second.rel_thrd != thrd))) {
+					++C.blocked;
+					if (W.brdcst) ++C.herd_blocked;
+				}
+			}
+			leave(C, thrd);
+			break;
+		}
+		case (event::COND_SIGNAL):
+		case (event::COND_BRDCST): {
+			cond_state& C = state(obj);
+			bool b = ev == event::COND_BRDCST;
+			++((b) ? C.brdcsts : C.signals);
+			if (C.waiters.empty()) {
+				++((b) ? C.lost_brdcsts : C.lost_signals);
+				break;
+			}
+			// a wake is due for each waiter the signal can wake that has none yet
+			size_t n = (b) ? C.waiters.size() : std::min(C.wakes.size() + 1, C.waiters.size());
+			while (C.wakes.size() < n) C.wakes.emplace_back(ts, b);
+			break;
+		}
+		case (event::LOCK_ACQ):
+			++locks[obj].holders;
+			if (W.cond == UINT32_MAX || W.reacquired) break;
+			W.reacquired = true;
+			W.mutex = obj;
+			break;
+		case (event::LOCK_REL): {
+			lock_state& L = locks[obj];
+			if (L.holders > 0) --L.holders;
+			L.rel_ts = ts;
+			L.rel_thrd = thrd;
+			if (waiting[thrd] != UINT32_MAX) { // the mutex, released by the wait
+				cond_state& C = state(waiting[thrd]);
+				if (C.mutex == UINT32_MAX) C.mutex = obj;
+				wait_mutex[thrd] = obj;
+			} else if (W.cond != UINT32_MAX && W.reacquired && W.mutex == obj) {
+				W.cond = UINT32_MAX;
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+};
+
+// convoys and handoff fairness of one lock (see parser::find_convoys())
+// a convoy is a run of contended acquisitions (waiting more than threshold
+// ticks) handing the lock round-robin between the same k >= 2 threads, for
+// at least CONVOY_ROUNDS rounds; it lasts from its first acquire to the last
+// release before the run broke
+// a release with threads waiting is a handoff: to the longest waiter (in
+// order), to another waiter (out of order), or barged, to a thread that was
+// not waiting, such as the releaser itself
+// a mutex reacquired on leaving a condvar wait has no request, so whether
+// its thread waited for it is unknown; such a handoff is counted apart
+// rather than as barged
+#define CONVOY_ROUNDS 3
+struct convoy_scanner {
+	struct waiter {
+		uint32_t thrd;
+		size_t since;
+		size_t overtaken; // acquires by threads that came later
+	};
+	// per thread: waits, longest wait, most times overtaken in one wait
+	struct thrd_waits {
+		size_t waits = 0;
+		size_t max_wait = 0;
+		size_t max_overtaken = 0;
+	};
+	std::vector<waiter> waiters; // in request order
+	// waiters at the last release, if not yet acquired since
+	std::vector<uint32_t> at_release;
+	uint32_t releaser = UINT32_MAX;
+	bool handoff = false;
+	size_t handoffs = 0, in_order = 0, out_of_order = 0, barged = 0, barged_self = 0;
+	size_t to_cond = 0; // handoffs to a thread leaving a condvar wait
+	std::unordered_map<uint32_t, thrd_waits> thrds;
+	// the current run: its acquires (thread and time) in order, and its
+	// round length (0 while the first round is still open)
+	std::vector<std::pair<uint32_t, size_t> > run;
+	size_t round = 0;
+	size_t last_rel = 0;
+	size_t convoys = 0, convoy_time = 0;
+	size_t longest = 0, longest_acqs = 0, longest_thrds = 0;
+	size_t first_ts = SIZE_MAX, last_ts = 0;
+
+	// close the current run (call at the end of the lock's history too)
+	void end_run () {
+		if (round > 0 && run.size() >= CONVOY_ROUNDS * round
+				&& last_rel > run.front().second) {
+			++convoys;
+			size_t d = last_rel - run.front().second;
+			convoy_time += d;
+			if (d > longest) {
+				longest = d;
+				longest_acqs = run.size();
+				longest_thrds = round;
+			}
+		}
+		run.clear();
+		round = 0;
+	}
+
+	// extend the run with a contended acquire by thrd at ts
+	void extend (uint32_t thrd, size_t ts) {
+		if (round > 0) {
+			if (run[run.size() - round].first == thrd) {
+				run.emplace_back(thrd, ts);
+				return;
+			}
+			end_run();
+		} else {
+			auto it = std::find_if(run.begin(), run.end(),
+				[thrd] (const std::pair<uint32_t, size_t>& a) {return a.first == thrd;});
+			if (it == run.begin() && run.size() >= 2) { // first round complete
+				round = run.size();
+			} else if (it != run.end()) { // out of turn: restart after its last turn
+				run.erase(run.begin(), it + 1);
+			}
+		}
+		run.emplace_back(thrd, ts);
+	}
+
+	void add (event ev, uint32_t thrd, size_t ts, size_t threshold) {
+		first_ts = std::min(first_ts, ts);
+		last_ts = std::max(last_ts, ts);
+		auto w = std::find_if(waiters.begin(), waiters.end(),
+			[thrd] (const waiter& x) {return x.thrd == thrd;});
+		switch (ev) {
+		case (event::LOCK_REQ):
+			if (w == waiters.end()) waiters.push_back({thrd, ts, 0});
+			break;
+		case (event::LOCK_ERR): // failed trylock
+			if (w != waiters.end()) waiters.erase(w);
+			break;
+		case (event::LOCK_ACQ): {
+			if (handoff && w == waiters.end()) { // no request
+				++to_cond;
+				handoff = false;
+			} else if (handoff) {
+				++handoffs;
+				if (at_release.front() == thrd) {
+					++in_order;
+				} else if (std::find(at_release.begin(), at_release.end(), thrd)
+						!= at_release.end()) {
+					++out_of_order;
+				} else {
+					++barged;
+					if (thrd == releaser) ++barged_self;
+				}
+				handoff = false;
+			}
+			size_t since = ts;
+			if (w != waiters.end()) {
+				since = w->since;
+				thrd_waits& T = thrds[thrd];
+				++T.waits;
+				T.max_wait = std::max(T.max_wait, ts - since);
+				T.max_overtaken = std::max(T.max_overtaken, w->overtaken);
+				waiters.erase(w);
+			}
+			for (waiter& x : waiters)
+				if (x.since < since || since == ts) ++x.overtaken;
+			if (ts - since > threshold) {
+				extend(thrd, ts);
+			} else {
+				end_run();
+			}
+			break;
+		}
+		case (event::LOCK_REL):
+			last_rel = ts;
+			at_release.clear();
+			for (waiter& x : waiters)
+				if (x.thrd != thrd) at_release.push_back(x.thrd);
+			releaser = thrd;
+			handoff = !at_release.empty();
+			break;
+		default:
+			break;
+		}
+	}
+};
+
+// locks sharing cache lines (see parser::find_false_sharing())
+// fed the lock events of all threads in global order, with the line of
+// each lock; acquiring or releasing a lock writes its line, so doing it
+// while another lock on the line is held by another thread pulls the line
+// away from that thread (a conflict), and the time locks on a line are held
+// by more than one thread at once is when such conflicts can happen
+struct sharing_scanner {
+	struct lock_use {
+		size_t acqs = 0;
+		size_t contended = 0; // acquisitions that waited longer than the threshold
+		size_t wait = 0;
+	};
+	struct line_state {
+		std::vector<std::pair<uint32_t, uint32_t> > held; // object and thread
+		size_t since = 0; // of the last change to held
+		size_t conflicts = 0;
+		size_t shared = 0; // time held by threads on different locks
+	};
+	std::unordered_map<uint32_t, lock_use> locks;
+	std::unordered_map<uint32_t, line_state> lines;
+	// request time of each thread's pending acquisition (SIZE_MAX if none)
+	std::vector<size_t> req;
+
+	sharing_scanner (size_t n_thrds) : req(n_thrds, SIZE_MAX) {}
+
+	// held by different threads on different locks
+	static bool is_shared (const line_state& L) {
+		for (auto& a : L.held)
+			for (auto& b : L.held)
+				if (a.first != b.first && a.second != b.second) return true;
+		return false;
+	}
+
+	void add (event ev, uint32_t thrd, uint32_t obj, uint32_t line, size_t ts,
+			size_t threshold) {
+		if (ev != event::LOCK_REQ && ev != event::LOCK_ACQ && ev != event::LOCK_REL
+				&& ev != event::LOCK_ERR)
+			return;
+		line_state& L = lines[line];
+		for (auto& h : L.held)
+			if (ev != event::LOCK_REQ && h.first != obj && h.second != thrd) {
+				++L.conflicts;
+				break;
+			}
+		if (is_shared(L)) L.shared += ts - L.since;
+		L.since = ts;
+		switch (ev) {
+		case (event::LOCK_REQ):
+			req[thrd] = ts;
+			break;
+		case (event::LOCK_ERR): // failed trylock
+			req[thrd] = SIZE_MAX;
+			break;
+		case (event::LOCK_ACQ): {
+			lock_use& U = locks[obj];
+			++U.acqs;
+			if (req[thrd] != SIZE_MAX) { // else reacquired after a condvar wait
+				U.wait += ts - req[thrd];
+				U.contended += (ts - req[thrd] > threshold);
+				req[thrd] = SIZE_MAX;
+			}
+			L.held.emplace_back(obj, thrd);
+			break;
+		}
+		case (event::LOCK_REL): {
+			auto h = std::find(L.held.rbegin(), L.held.rend(), std::make_pair(obj, thrd));
+			if (h != L.held.rend()) L.held.erase(std::next(h).base());
+			break;
+		}
+		default:
+			break;
+		}
+	}
+};
+
+// queue depth of one lock over time (see parser::find_queue_depth())
+// the lock's waiters (threads that requested it and have not acquired it
+// yet) and holders are step functions of time that change at its events;
+// each step adds its length to the histogram bin of its depth, and its
+// waiter-time and hold time to the timeline buckets it spans, so the whole
+// history is one pass, in O(events + buckets)
+// a mutex reacquired on leaving a condvar wait has no request, so its
+// waits do not show
+#define QUEUE_BINS 32 // depth histogram bins, the last one for all deeper queues
+struct depth_scanner {
+	std::vector<uint32_t> waiting; // threads
+	size_t holders = 0;
+	size_t first = SIZE_MAX, last = 0; // times of the first and last event
+	size_t max = 0;
+	size_t area = 0; // waiter-ticks
+	size_t held = 0; // ticks held by some thread
+	size_t bins[QUEUE_BINS] = {};
+	// timeline: n buckets of width ticks from begin, with the waiter-ticks,
+	// ticks held and most waiters in each
+	size_t begin, width;
+	std::vector<size_t> b_area, b_held;
+	std::vector<uint32_t> b_max;
+
+	depth_scanner (size_t begin, size_t width, size_t n) : begin(begin), width(width),
+		b_area(n, 0), b_held(n, 0), b_max(n, 0) {}
+
+	size_t bucket (size_t ts) const {
+		return std::min((ts - std::min(ts, begin)) / width, b_max.size() - 1);
+	}
+
+	void add (event ev, uint32_t thrd, size_t ts) {
+		if (first == SIZE_MAX) first = last = ts;
+		// the step since the last event
+		size_t d = waiting.size(), dt = ts - last;
+		bins[std::min<size_t>(d, QUEUE_BINS - 1)] += dt;
+		area += d * dt;
+		if (holders > 0) held += dt;
+		for (size_t k = bucket(last), e = bucket(ts); dt > 0 && k <= e; ++k) {
+			size_t lo = std::max(last, begin + k * width);
+			size_t hi = (k == e) ? ts : begin + (k + 1) * width;
+			if (hi <= lo) continue;
+			b_area[k] += d * (hi - lo);
+			if (holders > 0) b_held[k] += hi - lo;
+			b_max[k] = std::max(b_max[k], (uint32_t) d);
+		}
+		last = ts;
+
+		auto w = std::find(waiting.begin(), waiting.end(), thrd);
+		switch (ev) {
+		case (event::LOCK_REQ):
+			if (w == waiting.end()) waiting.push_back(thrd);
+			break;
+		case (event::LOCK_ERR): // failed trylock
+			if (w != waiting.end()) waiting.erase(w);
+			break;
+		case (event::LOCK_ACQ):
+			if (w != waiting.end()) waiting.erase(w);
+			++holders;
+			break;
+		case (event::LOCK_REL):
+			if (holders > 0) --holders;
+			break;
+		default:
+			break;
+		}
+		max = std::max(max, waiting.size());
+		size_t k = bucket(ts);
+		b_max[k] = std::max(b_max[k], (uint32_t) waiting.size());
+	}
+};
+
+// what one thread is doing over its lifetime (see parser::find_utilization())
+// fed the thread's events in order; from a lock request to the acquire it
+// waits for the lock, from a condvar wait to leaving it it waits on the
+// condvar (the mutex reacquire inside pthread_cond_wait() included), and
+// otherwise it runs; the time between its first event (its spawn) and its
+// last one (its exit) goes to the states it was in, and to the timeline
+// buckets it spans, like depth_scanner
+enum util_state : uint8_t {UTIL_RUN, UTIL_LOCK, UTIL_COND, UTIL_STATES};
+struct util_scanner {
+	util_state state = UTIL_RUN;
+	size_t first = SIZE_MAX, last = 0; // times of the first and last event
+	size_t ticks[UTIL_STATES] = {};
+	// timeline: n buckets of width ticks from begin, with the ticks in each
+	// state in each
+	size_t begin, width;
+	std::vector<size_t> b_ticks[UTIL_STATES];
+
+	util_scanner (size_t begin, size_t width, size_t n) : begin(begin), width(width) {
+		for (auto& b : b_ticks) b.assign(n, 0);
+	}
+
+	size_t bucket (size_t ts) const {
+		return std::min((ts - std::min(ts, begin)) / width, b_ticks[0].size() - 1);
+	}
+
+	void add (event ev, size_t ts) {
+		if (first == SIZE_MAX) first = last = ts;
+		size_t dt = ts - std::min(ts, last);
+		ticks[state] += dt;
+		for (size_t k = bucket(last), e = bucket(ts); dt > 0 && k <= e; ++k) {
+			size_t lo = std::max(last, begin + k * width);
+			size_t hi = (k == e) ? ts : begin + (k + 1) * width;
+			if (hi > lo) b_ticks[state][k] += hi - lo;
+		}
+		last = std::max(last, ts);
+
+		switch (ev) {
+		case (event::LOCK_REQ):
+			if (state == UTIL_RUN) state = UTIL_LOCK;
+			break;
+		case (event::LOCK_ACQ):
+		case (event::LOCK_ERR): // failed trylock
+			if (state == UTIL_LOCK) state = UTIL_RUN;
+			break;
+		case (event::COND_WAIT):
+			state = UTIL_COND;
+			break;
+		case (event::COND_LEAVE):
+		case (event::COND_ERR):
+			state = UTIL_RUN;
+			break;
+		default:
+			break;
+		}
+	}
+};
+
+// how far apart the cpus of two events are, by the closest level of the
+// topology they share
+enum cpu_dist : uint8_t {SAME_CPU, SAME_CORE, SAME_LLC, SAME_NODE, OTHER_NODE,
+	CPU_DISTS, NO_DIST = CPU_DISTS};
+
+// distance between cpus a and b (NO_DIST if either is unknown)
+inline cpu_dist cpu_distance (const std::vector<cpu_topo>& topo, uint16_t a, uint16_t b) {
+	if (a == NO_CPU || b == NO_CPU) return NO_DIST;
+	if (a == b) return SAME_CPU;
+	if (a >= topo.size() || b >= topo.size()) return NO_DIST;
+	const cpu_topo& A = topo[a];
+	const cpu_topo& B = topo[b];
+	if (A.node != B.node) return OTHER_NODE;
+	if (A.llc != B.llc) return SAME_NODE;
+	if (A.core != B.core) return SAME_LLC;
+	return SAME_CORE;
+}
+
+// cpu migration of one lock (see parser::find_migration())
+// an acquisition after a release is placed by the distance from the cpu it
+// ran on to that of the release, where the lock (and likely the data it
+// guards) was last written, and the hold it starts is timed under the same
+// distance
+struct migration_scanner {
+	struct hold {
+		uint32_t thrd;
+		size_t since;
+		cpu_dist dist;
+	};
+	const std::vector<cpu_topo>& topo;
+	uint16_t rel_cpu = NO_CPU; // of the last release
+	uint32_t rel_thrd = UINT32_MAX;
+	std::vector<hold> holds;
+	size_t acqs = 0;
+	// by distance: acquisitions, those released by another thread, and the
+	// holds they started
+	size_t handoffs[CPU_DISTS] = {};
+	size_t from_other[CPU_DISTS] = {};
+	size_t holds_done[CPU_DISTS] = {};
+	size_t hold_total[CPU_DISTS] = {};
+
+	migration_scanner (const std::vector<cpu_topo>& t) : topo(t) {}
+
+	void add (event ev, uint32_t thrd, size_t ts, uint16_t cpu) {
+		switch (ev) {
+		case (event::LOCK_ACQ): {
+			++acqs;
+			cpu_dist d = cpu_distance(topo, rel_cpu, cpu);
+			if (d != NO_DIST) {
+				++handoffs[d];
+				if (thrd != rel_thrd) ++from_other[d];
+			}
+			holds.push_back({thrd, ts, d});
+			break;
+		}
+		case (event::LOCK_REL): {
+			// the thread's latest hold, if the lock is recursive
+			auto h = std::find_if(holds.rbegin(), holds.rend(),
+				[thrd] (const hold& x) {return x.thrd == thrd;});
+			if (h != holds.rend()) {
+				if (h->dist != NO_DIST) {
+					++holds_done[h->dist];
+					hold_total[h->dist] += ts - h->since;
+				}
+				holds.erase(std::next(h).base());
+			}
+			rel_cpu = cpu;
+			rel_thrd = thrd;
+			break;
+		}
+		default:
+			break;
+		}
+	}
+};
+
+} // namespace lktrace
@@ -0,0 +1,115 @@
+// false sharing between locks: locks are grouped by cache line and page,
+// and a line holding several locks that different threads take at the same
+// time is flagged, as each acquire and release then pulls the line away from
+// the other holders (see sharing_scanner); lines are ranked by the combined
+// wait time of their locks, so the ones worth padding or aligning come first
+#include "parser.h"
+
+#include <map>
+#include <array>
+#include <algorithm> // sort()
+
+// bytes per cache line and per page
+#define LINE_BYTES 64
+#define PAGE_BYTES 4096
+
+namespace lktrace {
+
+// compute line_stats for every cache line holding a lock
+// an acquisition is contended if it waited more than threshold ticks
+void parser::find_false_sharing (size_t threshold) {
+	lk_lines.clear();
+	// line id of each object, by trace and address (merged traces only share
+	// lines if their objects are shared, see obj_procs)
+	std::map<std::pair<uint32_t, size_t>, uint32_t> line_ids;
+	std::vector<uint32_t> line_of (objs.size());
+	for (size_t o = 0; o < objs.size(); ++o) {
+		uint32_t proc = (obj_procs.empty()) ? 0 : obj_procs[o];
+		line_of[o] = line_ids.emplace(std::make_pair(proc, objs[o] / LINE_BYTES),
+			(uint32_t) line_ids.size()).first->second;
+	}
+
+	sharing_scanner S (thrds.size());
+	scan_global([&] (const event_store& E, size_t i) {
+		S.add(E.ev[i], E.thrd[i], E.obj[i], line_of[E.obj[i]], E.ts[i], threshold);
+	});
+
+	std::vector<size_t> at (line_ids.size(), SIZE_MAX); // in lk_lines
+	for (auto& [obj, U] : S.locks) {
+		if (U.acqs == 0) continue;
+		uint32_t l = line_of[obj];
+		if (at[l] == SIZE_MAX) {
+			at[l] = lk_lines.size();
+			const sharing_scanner::line_state& L = S.lines[l];
+			lk_lines.push_back({(obj_procs.empty()) ? 0 : obj_procs[obj],
+				objs[obj] / LINE_BYTES * LINE_BYTES, L.conflicts, L.shared, 0, {}});
+		}
+		line_stats& ls = lk_lines[at[l]];
+		ls.wait += U.wait;
+		ls.locks.emplace_back(obj, U.acqs, U.contended, U.wait);
+	}
+	for (line_stats& ls : lk_lines)
+		std::sort(ls.locks.begin(), ls.locks.end(), [this] (auto& a, auto& b) {
+			if (std::get<3>(a) != std::get<3>(b)) return std::get<3>(a) > std::get<3>(b);
+			return objs[std::get<0>(a)] < objs[std::get<0>(b)];
+		});
+	std::sort(lk_lines.begin(), lk_lines.end(), [] (const line_stats& a, const line_stats& b) {
+		if (a.wait != b.wait) return a.wait > b.wait;
+		if (a.conflicts != b.conflicts) return a.conflicts > b.conflicts;
+		if (a.addr != b.addr) return a.addr < b.addr;
+		return a.proc < b.proc;
+	});
+}
+
+// the flagged lines, then the pages holding more than one lock
+void parser::dump_false_sharing (std::ostream& outs) {
+	size_t flagged = 0;
+	for (const line_stats& ls : lk_lines) {
+		if (ls.locks.size() < 2 || ls.conflicts == 0) continue;
+		++flagged;
+		outs << "Cache line 0x" << std::hex << ls.addr << std::dec;
+		if (!obj_procs.empty()) outs << " (process " << proc_pids[ls.proc] << ')';
+		outs << ": " << ls.locks.size()
+			<< " locks, " << to_ns(ls.wait) << " ns waiting, " << ls.conflicts
+			<< " acquires/releases while another thread held another of them, held by "
+			<< "threads on different locks for " << to_ns(ls.shared) << " ns\n";
+		for (auto& [obj, acqs, contended, wait] : ls.locks)
+			outs << "\tlock 0x" << std::hex << objs[obj] << " (+" << std::dec
+				<< objs[obj] - ls.addr << "): " << acqs << " acquisitions, " << contended
+				<< " contended, " << to_ns(wait) << " ns waiting\n";
+		outs << '\n';
+	}
+	if (flagged == 0)
+		outs << "No cache line holds locks taken at the same time by different threads.\n\n";
+
+	// key=trace and page address, value=lines, locks, acquisitions,
+	// contended, wait, conflicts
+	std::map<std::pair<uint32_t, size_t>, std::array<size_t, 6> > pages;
+	for (const line_stats& ls : lk_lines) {
+		auto& p = pages[{ls.proc, ls.addr / PAGE_BYTES * PAGE_BYTES}];
+		++p[0];
+		p[1] += ls.locks.size();
+		for (auto& l : ls.locks) {
+			p[2] += std::get<1>(l);
+			p[3] += std::get<2>(l);
+		}
+		p[4] += ls.wait;
+		p[5] += ls.conflicts;
+	}
+	std::vector<std::pair<std::pair<uint32_t, size_t>, std::array<size_t, 6> > > ranked;
+	for (auto& p : pages)
+		if (p.second[1] > 1) ranked.push_back(p);
+	std::stable_sort(ranked.begin(), ranked.end(), [] (auto& a, auto& b) {
+		return a.second[4] > b.second[4];
+	});
+	for (auto& [page, p] : ranked) {
+		outs << "Page 0x" << std::hex << page.second << std::dec;
+		if (!obj_procs.empty()) outs << " (process " << proc_pids[page.first] << ')';
+		outs << ": " << p[1] << " locks on "
+			<< p[0] << " cache line(s), " << p[2] << " acquisitions, " << p[3]
+			<< " contended, " << to_ns(p[4]) << " ns waiting, " << p[5] << " conflicts\n";
+	}
+	if (!ranked.empty()) outs << '\n';
+}
+
+} // namespace lktrace
@@ -0,0 +1,131 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+#include "event.h"
+#include "tracefmt.h" // NO_CPU
+
+namespace lktrace {
+
+// columnar event store
+// each thread's events are stored contiguously in history order, and an event
+// is referred to by its index in the store; objects and callers are stored as
+// dense ids (see parser::objs and parser::callers); traces recorded with
+// stacks also have each event's calling context (see parser::cct), and
+// traces recorded with cpu ids each event's cpu (see parser::topo)
+//
+// the scans below are written as simple branch-free loops over one or two
+// columns so the compiler can vectorize them
+struct event_store {
+	std::vector<size_t> ts; // timestamp
+	std::vector<event> ev; // event code
+	std::vector<uint32_t> obj; // object id
+	std::vector<uint32_t> caller; // caller id
+	std::vector<uint32_t> thrd; // dense thread index
+	// calling context node id, only kept if with_ctx
+	std::vector<uint32_t> ctx;
+	bool with_ctx = false;
+	// cpu id (NO_CPU if unknown), only kept if with_cpu
+	std::vector<uint16_t> cpu;
+	bool with_cpu = false;
+
+	size_t size () const {return ts.size();}
+
+	void resize (size_t n) {
+		ts.resize(n);
+		ev.resize(n);
+		obj.resize(n);
+		caller.resize(n);
+		thrd.resize(n);
+		if (with_ctx) ctx.resize(n);
+		if (with_cpu) cpu.resize(n);
+	}
+
+	void push_back (size_t t, event e, uint32_t o, uint32_t c, uint32_t th,
+			uint32_t cx = 0, uint16_t cp = NO_CPU) {
+		ts.push_back(t);
+		ev.push_back(e);
+		obj.push_back(o);
+		caller.push_back(c);
+		thrd.push_back(th);
+		if (with_ctx) ctx.push_back(cx);
+		if (with_cpu) cpu.push_back(cp);
+	}
+
+	// copy event j to i (eg. when compacting)
+	void copy (size_t i, size_t j) {
+		ts[i] = ts[j];
+		ev[i] = ev[j];
+		obj[i] = obj[j];
+		caller[i] = caller[j];
+		thrd[i] = thrd[j];
+		if (with_ctx) ctx[i] = ctx[j];
+		if (with_cpu) cpu[i] = cpu[j];
+	}
+
+	// drop all but the last n events
+	void keep_last (size_t n) {
+		size_t drop = size() - std::min(n, size());
+		ts.erase(ts.begin(), ts.begin() + drop);
+		ev.erase(ev.begin(), ev.begin() + drop);
+		obj.erase(obj.begin(), obj.begin() + drop);
+		caller.erase(caller.begin(), caller.begin() + drop);
+		thrd.erase(thrd.begin(), thrd.begin() + drop);
+		if (with_ctx) ctx.erase(ctx.begin(), ctx.begin() + drop);
+		if (with_cpu) cpu.erase(cpu.begin(), cpu.begin() + drop);
+	}
+
+	// append indices in [begin, end) with event code e to out
+	void select_ev (event e, size_t begin, size_t end, std::vector<size_t>& out) const {
+		size_t n = out.size();
+		out.resize(n + (end - begin));
+		size_t* o = out.data() + n;
+		const event* E = ev.data();
+		for (size_t i = begin; i < end; ++i) {
+			*o = i;
+			o += (E[i] == e);
+		}
+		out.resize(o - out.data());
+	}
+
+	// append indices in [begin, end) on object id ob to out
+	void select_obj (uint32_t ob, size_t begin, size_t end, std::vector<size_t>& out) const {
+		size_t n = out.size();
+		out.resize(n + (end - begin));
+		size_t* o = out.data() + n;
+		const uint32_t* O = obj.data();
+		for (size_t i = begin; i < end; ++i) {
+			*o = i;
+			o += (O[i] == ob);
+		}
+		out.resize(o - out.data());
+	}
+
+	// count events in [begin, end) with event code e
+	size_t count_ev (event e, size_t begin, size_t end) const {
+		size_t n = 0;
+		const event* E = ev.data();
+		for (size_t i = begin; i < end; ++i) n += (E[i] == e);
+		return n;
+	}
+
+	// first index in [begin, end) with timestamp >= t
+	// timestamps must be ascending in the range (eg. a single thread)
+	size_t lower_ts (size_t begin, size_t end, size_t t) const {
+		return std::lower_bound(ts.begin() + begin, ts.begin() + end, t) - ts.begin();
+	}
+
+	// out[i] = ts[to[i]] - ts[from[i]]
+	// eg. hold times from matching acquire and release indices
+	void ts_deltas (const std::vector<size_t>& from, const std::vector<size_t>& to,
+			std::vector<size_t>& out) const {
+		size_t n = std::min(from.size(), to.size());
+		out.resize(n);
+		const size_t* T = ts.data();
+		for (size_t i = 0; i < n; ++i) out[i] = T[to[i]] - T[from[i]];
+	}
+};
+
+} // namespace lktrace
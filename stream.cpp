@@ -0,0 +1,269 @@
+// streaming mode: analyses over a binary trace without loading it
+// each thread's blocks are decoded a window of events at a time, and the
+// threads are merged by timestamp into the incremental scanners (scan.h),
+// so memory is bounded by the window size rather than the trace size
+#include "parser.h"
+#include "parallel.h"
+
+#include <memory> // unique_ptr
+
+namespace lktrace {
+
+// a thread's events, decoded from its blocks a window at a time
+struct thrd_cursor {
+	const std::vector<const index_entry*>* blocks;
+	uint32_t thrd; // dense index
+	size_t blk = 0; // next block to open
+	const char* p = nullptr; // next record of the open block
+	size_t ts = 0; // timestamp of the last record
+	size_t left = 0; // events left in the open block
+	bool ctx = false; // the open block's records have calling contexts
+	bool cpu = false; // and cpu ids
+	std::string raw; // backs the payload of a compressed block
+	event_store buf; // decoded events, after a tail of earlier ones
+	size_t pos = 0; // next event in buf
+
+	// decode the next window of events into buf, keeping a window of earlier
+	// events for repeated sections to copy; returns false at the end
+	bool refill (const char* file, size_t window, size_t n_objs, size_t n_callers) {
+		buf.keep_last(window);
+		pos = buf.size();
+		while (buf.size() - pos < window) {
+			if (left == 0) { // open the next block
+				if (blk == blocks->size()) break;
+				const index_entry& I = *(*blocks)[blk++];
+				const char* end;
+				p = block_payload(file, I, raw, end) + sizeof(thread_block_header);
+				ts = 0;
+				left = I.count;
+				ctx = I.flags & BLK_CTX;
+				buf.with_ctx = buf.with_ctx || ctx;
+				cpu = I.flags & BLK_CPU;
+				buf.with_cpu = buf.with_cpu || cpu;
+				continue;
+			}
+			ts += get_varint(p);
+			event ev = unpack_ev((uint8_t) *p++);
+			if (ev == event::SECT_RPT) {
+				size_t len = get_varint(p);
+				assert(len <= buf.size() && len <= left
+						&& "Repeated section longer than the stream window!");
+				size_t t = ts;
+				for (size_t k = 0; k < len; ++k) {
+					if (k > 0) t += get_varint(p);
+					size_t src = buf.size() - len;
+					buf.push_back(t, buf.ev[src], buf.obj[src], buf.caller[src], thrd,
+						(buf.with_ctx) ? buf.ctx[src] : 0,
+						(buf.with_cpu) ? buf.cpu[src] : NO_CPU);
+				}
+				left -= len;
+				continue;
+			}
+			size_t obj = get_varint(p);
+			size_t caller = get_varint(p);
+			assert(obj < n_objs && caller < n_callers && "Bad dictionary id!");
+			size_t cx = (ctx) ? get_varint(p) : 0;
+			size_t cp = (cpu) ? get_varint(p) : NO_CPU;
+			buf.push_back(ts, ev, (uint32_t) obj, (uint32_t) caller, thrd, (uint32_t) cx,
+				(uint16_t) cp);
+			--left;
+		}
+		return pos < buf.size();
+	}
+
+	// make sure there is a next event; returns false at the end
+	bool next (const char* file, size_t window, size_t n_objs, size_t n_callers) {
+		return pos < buf.size() || refill(file, window, n_objs, n_callers);
+	}
+};
+
+// set up streaming from the mapped binary trace in buf
+void parser::open_stream () {
+	assert(is_binary_trace(buf, buf_sz) && "Streaming needs a binary trace!");
+	read_index(buf, buf_sz);
+	assert(hdr.version == TRACE_VERSION && "Streaming needs a version 2 trace!");
+	// thread hooks are in the block headers
+	std::string raw;
+	for (size_t t = 0; t < thrds.size(); ++t) {
+		const char* end;
+		const char* p = block_payload(buf, *thrd_blocks[t].front(), raw, end);
+		thread_block_header th;
+		memcpy(&th, p, sizeof(thread_block_header));
+		thrds[t].hook = th.hook;
+	}
+	// filled in by stream_find()
+	caller_xref.assign(callers.size(), UINT32_MAX);
+}
+
+// merge the threads' cursors by (timestamp, dense thread index), like
+// build_global(), calling f(buf, i) for each (matching) event in global order
+template <class F> void parser::stream_merge (F f) {
+	std::vector<thrd_cursor> cur (thrds.size());
+	struct head {
+		size_t ts;
+		size_t thrd;
+		bool operator> (const head& h) const {
+			return ts > h.ts || (ts == h.ts && thrd > h.thrd);
+		}
+	};
+	std::vector<head> heap;
+	for (size_t t = 0; t < thrds.size(); ++t) {
+		cur[t].blocks = &thrd_blocks[t];
+		cur[t].thrd = (uint32_t) t;
+		if (cur[t].next(buf, window, objs.size(), callers.size()))
+			heap.push_back({cur[t].buf.ts[cur[t].pos], t});
+	}
+	auto cmp = [] (const head& a, const head& b) {return a > b;};
+	std::make_heap(heap.begin(), heap.end(), cmp);
+
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), cmp);
+		thrd_cursor& C = cur[heap.back().thrd];
+		if (!qry.active || query_match(C.buf, C.pos)) f(C.buf, C.pos);
+		++C.pos;
+		if (C.next(buf, window, objs.size(), callers.size())) {
+			heap.back().ts = C.buf.ts[C.pos];
+			std::push_heap(heap.begin(), heap.end(), cmp);
+		} else heap.pop_back();
+	}
+}
+
+// call f(S, i) for each event in global order, from the store or, in
+// streaming mode, decoded from the trace
+void parser::scan_global (const std::function<void (const event_store&, size_t)>& f) {
+	if (window > 0) {
+		stream_merge(f);
+		return;
+	}
+	build_global();
+	for (size_t i : global_hist) f(store, i);
+}
+
+void parser::time_span (size_t& lo, size_t& hi) const {
+	lo = SIZE_MAX;
+	hi = 0;
+	if (window > 0) {
+		for (auto& blocks : thrd_blocks) {
+			if (blocks.empty()) continue;
+			lo = std::min<size_t>(lo, blocks.front()->t_min);
+			hi = std::max<size_t>(hi, blocks.back()->t_max);
+		}
+	} else {
+		for (const thrd_info& T : thrds) {
+			if (T.begin == T.end) continue;
+			lo = std::min(lo, store.ts[T.begin]);
+			hi = std::max(hi, store.ts[T.end - 1]);
+		}
+	}
+	if (lo > hi) lo = hi = 0;
+}
+
+void parser::set_timeline (size_t n) {
+	size_t lo, hi;
+	time_span(lo, hi);
+	tl_begin = lo;
+	tl_width = (hi - lo) / n + 1;
+}
+
+void parser::stream_threads (std::ostream& outs) {
+	for (size_t t = 0; t < thrds.size(); ++t) {
+		outs << "=====\n";
+		dump_thread_header(outs, t);
+		thrd_cursor C;
+		C.blocks = &thrd_blocks[t];
+		C.thrd = (uint32_t) t;
+		for (; C.next(buf, window, objs.size(), callers.size()); ++C.pos)
+			if (!qry.active || query_match(C.buf, C.pos)) dump_event(outs, C.buf, C.pos);
+		outs << '\n';
+	}
+}
+
+void parser::stream_global (std::ostream& outs) {
+	stream_merge([&] (const event_store& S, size_t i) {
+		dump_global_event(outs, S, i);
+	});
+}
+
+// find_flame() with each thread decoded on its own, in parallel
+void parser::stream_flame (bool hold) {
+	std::vector<flame_scanner> F (thrds.size(), flame_scanner(hold));
+	parallel_for(thrds.size(), [&] (size_t t) {
+		thrd_cursor C;
+		C.blocks = &thrd_blocks[t];
+		C.thrd = (uint32_t) t;
+		for (; C.next(buf, window, objs.size(), callers.size()); ++C.pos)
+			if (!qry.active || query_match(C.buf, C.pos))
+				F[t].add(C.buf.ev[C.pos], C.buf.obj[C.pos],
+					(C.buf.with_ctx) ? C.buf.ctx[C.pos] : C.buf.caller[C.pos],
+					C.buf.ts[C.pos]);
+	});
+	merge_flame(F);
+}
+
+// find_utilization() with each thread decoded on its own, in parallel
+void parser::stream_utilization (size_t buckets) {
+	buckets = std::max<size_t>(buckets, 1);
+	set_timeline(buckets);
+	std::vector<util_scanner> U (thrds.size(), util_scanner(tl_begin, tl_width, buckets));
+	parallel_for(thrds.size(), [&] (size_t t) {
+		thrd_cursor C;
+		C.blocks = &thrd_blocks[t];
+		C.thrd = (uint32_t) t;
+		for (; C.next(buf, window, objs.size(), callers.size()); ++C.pos)
+			if (!qry.active || query_match(C.buf, C.pos))
+				U[t].add(C.buf.ev[C.pos], C.buf.ts[C.pos]);
+	});
+	merge_utilization(U);
+}
+
+// run find_deps(), find_patterns() and find_locks() in one merged pass
+// the lock report shares it rather than take its own pass through
+// scan_locks(), so that the trace is decoded and merged once for all three
+void parser::stream_find (bool deps, bool pats, bool locks, size_t min_depth,
+		size_t threshold) {
+	std::vector<section_scanner> sections (deps ? thrds.size() : 0);
+	std::vector<thrd_sections> thrd_pats (deps ? thrds.size() : 0);
+	std::vector<quiescent_scanner> quiescent (pats ? thrds.size() : 0);
+	lk_patterns.resize(pats ? thrds.size() : 0);
+	std::vector<std::unique_ptr<lock_scanner> > lock_scan (locks ? objs.size() : 0);
+	// thread that set each caller's xref, to keep the first one in store
+	// order like build_xref()
+	std::vector<uint32_t> xref_thrd (callers.size(), UINT32_MAX);
+
+	stream_merge([&] (const event_store& S, size_t i) {
+		uint32_t t = S.thrd[i];
+		event ev = S.ev[i];
+		if (t < xref_thrd[S.caller[i]]) {
+			xref_thrd[S.caller[i]] = t;
+			caller_xref[S.caller[i]] = S.obj[i];
+		}
+
+		size_t dur;
+		if (deps && sections[t].add(ev, S.caller[i], S.ts[i], dur)) {
+			section_scanner& D = sections[t];
+			if (D.pattern.size()/2 >= min_depth) count_section(thrd_pats[t], D, dur);
+			D.reset();
+		}
+		if (pats && quiescent[t].add(ev, S.caller[i])) {
+			count_pattern(lk_patterns[t], quiescent[t].pattern, quiescent[t].hash);
+			quiescent[t].reset();
+		}
+		if (locks && is_lock_event(ev)) {
+			auto& L = lock_scan[S.obj[i]];
+			if (!L) L.reset(new lock_scanner(STREAM_SAMPLES));
+			L->add(ev, t, S.caller[i], S.ts[i], threshold);
+		}
+	});
+
+	if (deps) merge_deps(thrd_pats);
+	for (size_t o = 0; o < lock_scan.size(); ++o) {
+		if (!lock_scan[o]) continue;
+		lk_stats.emplace_back();
+		lk_stats.back().obj = (uint32_t) o;
+		lock_result(*lock_scan[o], lk_stats.back());
+		lock_scan[o].reset();
+	}
+	if (locks) rank_locks();
+}
+
+} // namespace lktrace
@@ -0,0 +1,194 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <string>
+
+#include "event.h"
+
+// binary trace file format, shared between the tracer and the parser
+//
+// a trace file is laid out as:
+//	file_header
+//	blocks (block_header + payload): an address dictionary, a calling
+//		context tree (if recorded with stacks), a cpu topology (if
+//		recorded with cpu ids), one or more blocks per thread (in history
+//		order), a lock-set block and a string table
+//	index (one index_entry per block)
+//	file_footer
+// all fields are native-endian; the parser detects the format by the magic
+// and falls back to the old text format if it is absent
+
+namespace lktrace {
+
+#define TRACE_MAGIC "LKTRACE" // includes terminator (8 bytes)
+#define INDEX_MAGIC "LKTRIDX"
+#define TRACE_VERSION 2
+// max records per thread block (version 2)
+#define BLOCK_RECORDS (1 << 16)
+
+struct file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags; // ctl_flag values the trace was recorded with
+	uint64_t pid;
+	// clock calibration: CLOCK_MONOTONIC and CLOCK_REALTIME (ns)
+	// at timestamp zero, and the timestamp tick period in seconds (num/den)
+	uint64_t mono_base;
+	uint64_t real_base;
+	uint64_t tick_num;
+	uint64_t tick_den;
+};
+
+enum class block_type : uint32_t {THREAD = 0x1, STRTAB = 0x2, DICT = 0x3,
+	LOCKSET = 0x4, CCT = 0x5, TOPOLOGY = 0x6};
+
+enum block_flag : uint32_t {BLK_NONE = 0x0,
+	// payload is uint64 raw size, uint64 compressed size and the
+	// lz_compress()ed payload (see lz.h)
+	BLK_LZ = 0x1,
+	// thread block whose repeated sections only repeat events of the same
+	// block, so it can be decoded without the blocks before it
+	BLK_INDEP = 0x2,
+	// thread block whose event records end with a calling context node id
+	BLK_CTX = 0x4,
+	// thread block whose event records end with a cpu id
+	BLK_CPU = 0x8};
+
+// block payloads are zero-padded to a multiple of 8 bytes
+struct block_header {
+	block_type type;
+	uint32_t flags;
+	uint64_t size; // of payload following this header
+};
+
+// thread block payload: thread_block_header followed by event records
+struct thread_block_header {
+	uint64_t tid;
+	uint64_t hook;
+};
+
+// version 2 event records are varint-packed (see put_varint()):
+//	ts delta from the previous record in the block (from 0 for the first)
+//	event byte (see pack_ev())
+//	object id, caller id (indices into the dictionary block)
+//	calling context node id (BLK_CTX blocks only)
+//	cpu id the event ran on, or NO_CPU (BLK_CPU blocks only)
+// a SECT_RPT record has the section length in place of the ids,
+// followed by length-1 timing deltas
+//
+// the dictionary block payload is uint64 object count, uint64 caller count,
+// then the object and caller addresses as uint64s; the callers include the
+// outer frames of recorded stacks
+//
+// the calling context tree block holds the stacks of all events (count
+// nodes): node 0 is the root, and nodes 1 to count follow as varint pairs of
+// parent node id (less than the node's own) and caller id of the frame, so
+// an event's stack is the path from its node up to the root, innermost
+// frame (the event's caller) first
+//
+// the topology block has a varint triple (see cpu_topo) for each of the
+// count cpus the system can have, by cpu id
+
+// the lock-set block payload has a LOCKSET_WORDS bloom filter of the object
+// ids in each thread block (see lockset_add()), in index order; readers use
+// it to skip blocks that cannot involve a given object
+
+// cpu id of an event whose cpu is unknown
+#define NO_CPU 0xFFFF
+
+// where a cpu sits: the lowest cpu id sharing its core (hyperthreads) and
+// its last level cache, and its NUMA node
+struct cpu_topo {
+	uint32_t core;
+	uint32_t llc;
+	uint32_t node;
+};
+
+// version 1 fixed-width event record
+// a SECT_RPT record (obj = section length) is followed by obj-1 uint32
+// timing deltas, zero-padded to a multiple of 8 bytes
+struct event_record {
+	uint64_t ts;
+	uint64_t obj;
+	uint64_t caller;
+	uint16_t ev;
+	uint16_t pad[3];
+};
+
+// string table payload: entries of
+//	uint64 addr, uint32 length, char[length] (no terminator)
+// packed back to back
+
+struct index_entry {
+	uint64_t offset; // of the block_header from start of file
+	block_type type;
+	uint32_t flags; // same as the block_header
+	uint64_t tid; // 0 for non-thread blocks
+	uint64_t t_min; // timestamp range of the block's events
+	uint64_t t_max;
+	uint64_t count; // event count, with repeated sections expanded
+};
+
+struct file_footer {
+	uint64_t index_offset;
+	uint64_t index_count;
+	char magic[8];
+};
+
+// LEB128 varints
+inline void put_varint (std::string& buf, uint64_t v) {
+	while (v >= 0x80) {
+		buf += (char) (v | 0x80);
+		v >>= 7;
+	}
+	buf += (char) v;
+}
+
+inline uint64_t get_varint (const char*& p) {
+	const uint8_t* b = (const uint8_t*) p;
+	uint64_t v = *b & 0x7f;
+	unsigned shift = 7;
+	while (*b & 0x80) {
+		++b;
+		v |= (uint64_t) (*b & 0x7f) << shift;
+		shift += 7;
+	}
+	p = (const char*) (b + 1);
+	return v;
+}
+
+// all event codes have the form 0xXFFY (see event.h),
+// so the two varying nibbles fit in a byte
+inline uint8_t pack_ev (event ev) {
+	uint16_t c = (uint16_t) ev;
+	assert((c & 0x0FF0) == 0x0FF0);
+	return (uint8_t) (((c >> 8) & 0xF0) | (c & 0x0F));
+}
+
+inline event unpack_ev (uint8_t b) {
+	return (event) (((uint16_t) (b & 0xF0) << 8) | 0x0FF0 | (b & 0x0F));
+}
+
+// lock-set bloom filters: 3 bits per object id
+#define LOCKSET_WORDS 8
+
+inline void lockset_add (uint64_t* set, uint64_t id) {
+	uint64_t h = id * 0x9e3779b97f4a7c15;
+	for (int k = 0; k < 3; ++k, h <<= 9)
+		set[(h >> 61) & 7] |= (uint64_t) 1 << ((h >> 55) & 63);
+}
+
+inline bool lockset_test (const uint64_t* set, uint64_t id) {
+	uint64_t h = id * 0x9e3779b97f4a7c15;
+	for (int k = 0; k < 3; ++k, h <<= 9)
+		if (!(set[(h >> 61) & 7] & ((uint64_t) 1 << ((h >> 55) & 63)))) return false;
+	return true;
+}
+
+inline bool is_binary_trace (const char* buf, size_t sz) {
+	return sz >= sizeof(file_header) + sizeof(file_footer) &&
+		memcmp(buf, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0;
+}
+
+} // namespace lktrace
@@ -1,5 +1,6 @@
 #include "tracer.h"
 #include "addr2line.h" // avoid multiple defns
+#include "lz.h"
 
 namespace lktrace {
 
@@ -21,6 +22,10 @@ tracer_ctl::tracer_ctl() {
 	unsigned *num_pt = (unsigned*) ctl_v;
 	tskip = *num_pt;
 	++num_pt;
+	flags = *num_pt;
+	++num_pt;
+	depth = *num_pt;
+	++num_pt;
 	const char *str_pt = (const char*) num_pt;
 	prefix = str_pt;
 	while (*str_pt != '\0') ++str_pt;
@@ -30,7 +35,7 @@ tracer_ctl::tracer_ctl() {
 	++str_pt;
 	tdir = str_pt;
 	// sanity check
-	assert((sizeof(unsigned) +
+	assert((2*sizeof(unsigned) + sizeof(uint32_t) +
 		strlen(prefix) + 1 +
 		strlen(wrdir) + 1 +
 		strlen(tdir) + 1) ==
@@ -58,6 +63,7 @@ tracer::tracer() :
        	init_guard(false),	
 	histories(MAX_THRD_COUNT, 1), 
 	init_time(chrono::steady_clock::now()),
+	init_real(chrono::system_clock::now()),
 	ctl() {
 		// register this tracer instance with the master
 		instance_sock = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -77,6 +83,8 @@ tracer::tracer() :
 				hist_entry::alloc_start, hist_entry::alloc_end);
 		// set trace skip
 		hist_entry::trace_skip = ctl.get_tskip();
+		hist_entry::stack_depth = ctl.get_depth();
+		hist_entry::record_cpu = ctl.get_flag(CTL_CPU);
 		// register master thread
 		void* buf[2];
 		e = backtrace(buf, 2);
@@ -109,9 +117,6 @@ tracer::~tracer () { // purpose of this destructor is to write out our results
 
 	if (multithreaded) { // don't write anything out if there was never >1 thread
 
-	// when we find a dscriptor string for an address using addr2line, we store it here
-	std::unordered_map<size_t, std::string> caller_name_cache;
-
 	// write files in directory where lktrace was called
 	int e = chdir(ctl.get_wrdir());
 	assert(e == 0);
@@ -120,49 +125,91 @@ tracer::~tracer () { // purpose of this destructor is to write out our results
 	fname += '-';
 	fname += to_string(getpid());
 
-	ofstream outfile (fname);
+	ofstream outfile (fname, ios::binary);
 	assert(outfile.is_open());
 
 	e = chdir(ctl.get_tdir()); // switch back to target dir so addr2line works correctly
 	assert(e == 0);
 
-	// we write out each history individually
+	if (ctl.get_flag(CTL_TEXT)) write_text(outfile);
+	else write_binary(outfile);
+
+	addr2line_cache_cleanup(); // close opened object files
+	outfile.close();
+
+	} // if (multithreaded)
+
+	// clean up cds
+	cds::threading::Manager::detachThread();
+	cds::Terminate();
+
+	// deregister tracer instance with master
+	close(instance_sock);
+}
+
+// look up descriptor strings (via addr2line) for thread hooks and callers
+std::unordered_map<size_t, std::string> tracer::resolve_names() {
+	std::unordered_map<size_t, std::string> caller_name_cache;
 	for (auto hist_it = histories.begin(); hist_it != histories.end(); ++hist_it) {
-		size_t tid = hist_it->first;
-		vector<hist_entry> hist = hist_it->second;
+		const vector<hist_entry>& hist = hist_it->second.hist;
 		assert(hist.front().ev == event::THRD_SPAWN);
-		
+
 		// get the name of the thread hook
-		auto h_it = caller_name_cache.find((size_t) hist.front().addr);
-		if (h_it == caller_name_cache.end()) {
+		if (caller_name_cache.find(hist.front().addr) == caller_name_cache.end()) {
 			std::string name = (hist.front().addr == 0) ? "<program entry point>"
-				: addr2line((size_t) hist.front().addr);	
-			auto emplit = caller_name_cache.insert(
-				std::make_pair((size_t) hist.front().addr, name));
-			assert(emplit.second);
+				: addr2line(hist.front().addr);
+			caller_name_cache.insert(std::make_pair(hist.front().addr, name));
 		}
-		
-		outfile << '[';
-		if (tid == get_tid()) outfile << "t";
-		else outfile << "t"; 
-		outfile << ":0x" << hex << tid << ":0x" << hist.front().addr << "]\n";
-		for (hist_entry& entry : hist) {
-			// write timestamp
-			outfile << dec << (entry.ts - init_time).count() << ':';
-			// write event code
-			outfile << ev_code_to_str(entry.ev);
-			// write object & caller addrs
-			outfile << ":0x" << hex << entry.addr
-				<< ":0x" << (size_t) entry.caller << '\n';
 
-			// look up and cache caller name if not already present
+		for (const hist_entry& entry : hist) {
+			if (entry.ev == event::SECT_RPT) continue; // no caller
 			auto call_it = caller_name_cache.find((size_t) entry.caller);
 			if (call_it == caller_name_cache.end()) {
-				std::string name = addr2line((size_t) entry.caller);	
+				std::string name = addr2line((size_t) entry.caller);
 				caller_name_cache.insert(
 					std::make_pair((size_t) entry.caller, name));
 			}
+		}
+		// and the frames of its stacks
+		const auto& nodes = hist_it->second.cct.nodes;
+		for (size_t k = 1; k < nodes.size(); ++k)
+			if (caller_name_cache.find(nodes[k].pc) == caller_name_cache.end())
+				caller_name_cache.emplace(nodes[k].pc, addr2line(nodes[k].pc));
+	}
+	return caller_name_cache;
+}
+
+// write the old hex text format
+void tracer::write_text(ofstream& outfile) {
+	std::unordered_map<size_t, std::string> caller_name_cache = resolve_names();
+
+	// we write out each history individually
+	for (auto hist_it = histories.begin(); hist_it != histories.end(); ++hist_it) {
+		size_t tid = hist_it->first;
+		const vector<hist_entry>& hist = hist_it->second.hist;
+		auto delta_it = hist_it->second.rpt_deltas.begin();
 
+		outfile << "[t:0x" << hex << tid << ":0x" << hist.front().addr << "]\n";
+		for (const hist_entry& entry : hist) {
+			// write timestamp
+			outfile << dec << (entry.ts - init_time).count() << ':';
+			// write event code
+			outfile << ev_code_to_str(entry.ev);
+			if (entry.ev == event::SECT_RPT) {
+				// write section length & timing deltas
+				outfile << ":0x" << hex << entry.addr << ':' << dec;
+				for (size_t d = 1; d < entry.addr; ++d) {
+					assert(delta_it != hist_it->second.rpt_deltas.end());
+					outfile << *delta_it;
+					if (d != entry.addr - 1) outfile << ',';
+					++delta_it;
+				}
+				outfile << '\n';
+				continue;
+			}
+			// write object & caller addrs
+			outfile << ":0x" << hex << entry.addr
+				<< ":0x" << (size_t) entry.caller << '\n';
 		}
 		outfile << '\n';
 	}
@@ -172,18 +219,249 @@ tracer::~tracer () { // purpose of this destructor is to write out our results
 		outfile << "0x" << caller.first << ':' << caller.second << '\n';
 	}
 	outfile << '\n';
+}
 
-	addr2line_cache_cleanup(); // close opened object files
-	outfile.close();
+// first cpu id in a sysfs cpu list (eg. "0-3,8-11"), or dflt if unreadable
+static uint32_t first_cpu (const std::string& path, uint32_t dflt) {
+	ifstream in (path);
+	uint32_t c;
+	return (in >> c) ? c : dflt;
+}
 
-	} // if (multithreaded)
+// cpu topology from sysfs, for every cpu the system can have
+// a cpu whose entries are missing is taken as its own core and cache, on node 0
+static vector<cpu_topo> read_topology () {
+	vector<cpu_topo> topo;
+	long n = sysconf(_SC_NPROCESSORS_CONF);
+	for (long c = 0; c < n; ++c) {
+		std::string dir = "/sys/devices/system/cpu/cpu" + to_string(c);
+		cpu_topo T = {(uint32_t) c, (uint32_t) c, 0};
+		T.core = first_cpu(dir + "/topology/thread_siblings_list", T.core);
+		T.llc = T.core;
+		// the last level cache is the cache index of the highest level
+		unsigned top = 0;
+		for (int k = 0; ; ++k) {
+			std::string idx = dir + "/cache/index" + to_string(k);
+			ifstream in (idx + "/level");
+			unsigned level;
+			if (!(in >> level)) break;
+			if (level >= top) {
+				top = level;
+				T.llc = first_cpu(idx + "/shared_cpu_list", T.llc);
+			}
+		}
+		// the node is a nodeN link in the cpu's directory
+		if (DIR* d = opendir(dir.c_str())) {
+			while (dirent* e = readdir(d))
+				if (strncmp(e->d_name, "node", 4) == 0 && isdigit(e->d_name[4]))
+					T.node = strtoul(e->d_name + 4, nullptr, 10);
+			closedir(d);
+		}
+		topo.push_back(T);
+	}
+	return topo;
+}
 
-	// clean up cds
-	cds::threading::Manager::detachThread();
-	cds::Terminate();
+// write the binary format (see tracefmt.h)
+void tracer::write_binary(ofstream& outfile) {
+	std::unordered_map<size_t, std::string> caller_name_cache = resolve_names();
+	std::vector<index_entry> index;
+	std::string buf; // payload of the block being written
+	std::string raw; // uncompressed payload (if compressing)
+
+	file_header hdr;
+	memset(&hdr, 0, sizeof(file_header));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.flags = ctl.get_flags();
+	hdr.pid = getpid();
+	hdr.mono_base = chrono::duration_cast<chrono::nanoseconds>(
+		init_time.time_since_epoch()).count();
+	hdr.real_base = chrono::duration_cast<chrono::nanoseconds>(
+		init_real.time_since_epoch()).count();
+	hdr.tick_num = chrono::steady_clock::period::num;
+	hdr.tick_den = chrono::steady_clock::period::den;
+	outfile.write((const char*) &hdr, sizeof(file_header));
+
+	// append a block to the file and the index
+	auto write_block = [&] (index_entry& I) {
+		if (ctl.get_flag(CTL_COMPRESS)) {
+			raw.swap(buf);
+			uint64_t sizes[2] = {raw.size(), 0};
+			buf.assign((const char*) sizes, sizeof(sizes));
+			lz_compress(raw.data(), raw.size(), buf);
+			sizes[1] = buf.size() - sizeof(sizes);
+			memcpy(&buf[0], sizes, sizeof(sizes));
+			I.flags |= BLK_LZ;
+		}
+		buf.append((8 - buf.size() % 8) % 8, '\0'); // keep blocks aligned
+		I.offset = (uint64_t) outfile.tellp();
+		block_header bh = {I.type, I.flags, buf.size()};
+		outfile.write((const char*) &bh, sizeof(block_header));
+		outfile.write(buf.data(), buf.size());
+		index.push_back(I);
+		buf.clear();
+	};
+
+	// number object and caller addresses
+	std::unordered_map<size_t, uint64_t> obj_ids;
+	std::unordered_map<size_t, uint64_t> caller_ids;
+	std::vector<uint64_t> objs;
+	std::vector<uint64_t> callers;
+	for (auto hist_it = histories.begin(); hist_it != histories.end(); ++hist_it) {
+		for (const hist_entry& entry : hist_it->second.hist) {
+			if (entry.ev == event::SECT_RPT) continue;
+			if (obj_ids.emplace(entry.addr, objs.size()).second)
+				objs.push_back(entry.addr);
+			if (caller_ids.emplace((size_t) entry.caller, callers.size()).second)
+				callers.push_back((size_t) entry.caller);
+		}
+	}
+	// with stacks, the threads' calling context trees are merged into one
+	// (cct_ids maps each thread's nodes to it), and the frames are callers
+	bool stacks = hist_entry::stack_depth > 0;
+	calling_context cct;
+	std::unordered_map<size_t, std::vector<uint32_t> > cct_ids;
+	for (auto hist_it = histories.begin(); stacks && hist_it != histories.end(); ++hist_it) {
+		const auto& nodes = hist_it->second.cct.nodes;
+		std::vector<uint32_t>& ids = cct_ids[hist_it->first];
+		ids.assign(nodes.size(), 0);
+		for (size_t k = 1; k < nodes.size(); ++k) // parents come first
+			ids[k] = cct.intern(ids[nodes[k].parent], nodes[k].pc);
+	}
+	for (size_t k = 1; k < cct.nodes.size(); ++k)
+		if (caller_ids.emplace(cct.nodes[k].pc, callers.size()).second)
+			callers.push_back(cct.nodes[k].pc);
+
+	uint64_t dict_counts[2] = {objs.size(), callers.size()};
+	buf.append((const char*) dict_counts, sizeof(dict_counts));
+	buf.append((const char*) objs.data(), objs.size() * sizeof(uint64_t));
+	buf.append((const char*) callers.data(), callers.size() * sizeof(uint64_t));
+	index_entry D = {0, block_type::DICT, 0, 0, 0, 0, objs.size() + callers.size()};
+	write_block(D);
+
+	if (stacks) { // calling context tree
+		for (size_t k = 1; k < cct.nodes.size(); ++k) {
+			put_varint(buf, cct.nodes[k].parent);
+			put_varint(buf, caller_ids.at(cct.nodes[k].pc));
+		}
+		index_entry C = {0, block_type::CCT, 0, 0, 0, 0, cct.nodes.size() - 1};
+		write_block(C);
+	}
 
-	// deregister tracer instance with master
-	close(instance_sock);
+	bool cpus = ctl.get_flag(CTL_CPU);
+	if (cpus) { // cpu topology
+		vector<cpu_topo> topo = read_topology();
+		for (const cpu_topo& T : topo) {
+			put_varint(buf, T.core);
+			put_varint(buf, T.llc);
+			put_varint(buf, T.node);
+		}
+		index_entry T = {0, block_type::TOPOLOGY, 0, 0, 0, 0, topo.size()};
+		write_block(T);
+	}
+
+	// thread histories, split into blocks of BLOCK_RECORDS
+	// a repeated section that starts a block would repeat events of the
+	// block before, so it is written out in full to keep blocks independent
+	std::string lockset; // bloom filter of each thread block's objects
+	for (auto hist_it = histories.begin(); hist_it != histories.end(); ++hist_it) {
+		const vector<hist_entry>& hist = hist_it->second.hist;
+		auto delta_it = hist_it->second.rpt_deltas.begin();
+		thread_block_header th = {hist_it->first, hist.front().addr};
+		// recorded entries behind the latest expanded events
+		vector<const hist_entry*> recent;
+		const uint32_t* ctx_ids = (stacks) ? cct_ids.at(hist_it->first).data() : nullptr;
+
+		for (size_t b = 0; b < hist.size(); b += BLOCK_RECORDS) {
+			index_entry I = {0, block_type::THREAD, BLK_INDEP, hist_it->first, 0, 0, 0};
+			if (stacks) I.flags |= BLK_CTX;
+			if (cpus) I.flags |= BLK_CPU;
+			uint64_t set[LOCKSET_WORDS] = {};
+			buf.append((const char*) &th, sizeof(thread_block_header));
+			size_t prev_ts = 0;
+			if (recent.size() > 2 * BLOCK_RECORDS) // keep the window bounded
+				recent.erase(recent.begin(), recent.end() - BLOCK_RECORDS);
+
+			for (size_t r = b; r < hist.size() && r < b + BLOCK_RECORDS; ++r) {
+				const hist_entry& entry = hist[r];
+				size_t ts = (entry.ts - init_time).count();
+				if (I.count == 0) I.t_min = ts;
+				I.t_max = ts;
+				if (entry.ev != event::SECT_RPT) {
+					put_varint(buf, ts - prev_ts);
+					buf += (char) pack_ev(entry.ev);
+					prev_ts = ts;
+					put_varint(buf, obj_ids.at(entry.addr));
+					put_varint(buf, caller_ids.at((size_t) entry.caller));
+					if (stacks) put_varint(buf, ctx_ids[entry.ctx]);
+					if (cpus) put_varint(buf, entry.cpu);
+					lockset_add(set, obj_ids.at(entry.addr));
+					recent.push_back(&entry);
+					++I.count;
+					continue;
+				}
+				// repeated section: length and timing deltas, or in full if
+				// it repeats events of the block before
+				size_t len = entry.addr;
+				assert(len <= recent.size() && "Repeat of missing section!");
+				size_t src = recent.size() - len;
+				bool full = (len > I.count);
+				if (!full) {
+					put_varint(buf, ts - prev_ts);
+					buf += (char) pack_ev(entry.ev);
+					prev_ts = ts;
+					put_varint(buf, len);
+				}
+				for (size_t d = 0; d < len; ++d) {
+					if (d > 0) {
+						assert(delta_it != hist_it->second.rpt_deltas.end());
+						if (!full) put_varint(buf, *delta_it);
+						ts += *delta_it;
+						I.t_max = ts;
+						++delta_it;
+					}
+					const hist_entry* e = recent[src + d];
+					if (full) {
+						put_varint(buf, ts - prev_ts);
+						buf += (char) pack_ev(e->ev);
+						prev_ts = ts;
+						put_varint(buf, obj_ids.at(e->addr));
+						put_varint(buf, caller_ids.at((size_t) e->caller));
+						if (stacks) put_varint(buf, ctx_ids[e->ctx]);
+						if (cpus) put_varint(buf, e->cpu);
+						lockset_add(set, obj_ids.at(e->addr));
+					}
+					recent.push_back(e);
+				}
+				I.count += len;
+			}
+			write_block(I);
+			lockset.append((const char*) set, sizeof(set));
+		}
+	}
+	buf.swap(lockset);
+	index_entry L = {0, block_type::LOCKSET, 0, 0, 0, 0,
+		buf.size() / (LOCKSET_WORDS * sizeof(uint64_t))};
+	write_block(L);
+
+	// string table
+	index_entry I = {0, block_type::STRTAB, 0, 0, 0, 0, caller_name_cache.size()};
+	for (auto& caller : caller_name_cache) {
+		uint64_t addr = caller.first;
+		uint32_t len = caller.second.size();
+		buf.append((const char*) &addr, sizeof(uint64_t));
+		buf.append((const char*) &len, sizeof(uint32_t));
+		buf.append(caller.second);
+	}
+	write_block(I);
+
+	file_footer ftr;
+	ftr.index_offset = (uint64_t) outfile.tellp();
+	ftr.index_count = index.size();
+	memcpy(ftr.magic, INDEX_MAGIC, sizeof(ftr.magic));
+	outfile.write((const char*) index.data(), index.size() * sizeof(index_entry));
+	outfile.write((const char*) &ftr, sizeof(file_footer));
 }
 
 void tracer::add_this_thread(size_t hook, void* caller, bool mt) {
@@ -197,7 +475,7 @@ void tracer::add_this_thread(size_t hook, void* caller, bool mt) {
 	// get our list back
 	hist_map::iterator hist = histories.contains(tid);
 	assert(hist != histories.end());
-	hist->second.emplace_back(event::THRD_SPAWN, hook, caller);
+	hist->second.hist.emplace_back(event::THRD_SPAWN, hook, caller);
 }
 
 void tracer::sever_this_thread(bool mt) {
@@ -209,7 +487,7 @@ void tracer::sever_this_thread(bool mt) {
 	void* buf[3];
 	int e = backtrace(buf, 3);
 	assert(e == 3);
-	hist->second.emplace_back(event::THRD_EXIT, tid, buf[2]);
+	hist->second.hist.emplace_back(event::THRD_EXIT, tid, buf[2]);
 	// deregister thread with cds
 	if (mt) cds::threading::Manager::detachThread();
 }
@@ -225,9 +503,82 @@ void tracer::add_event(event e, size_t obj_addr) {
 	// appears to be the memory allocator (we get infinite recursion otherwise)
 	// if this occurs we continue silently (not an error, as such)
 	try {
-		hist_entry ev (e, obj_addr);
-		hist->second.push_back(ev);
-	} catch (std::bad_alloc& e) {}	
+		hist_entry ev = (hist_entry::stack_depth)
+			? hist_entry(e, obj_addr, hist->second.cct) : hist_entry(e, obj_addr);
+		hist->second.hist.push_back(ev);
+	} catch (std::bad_alloc& e) {return;}
+
+	if (!ctl.get_flag(CTL_NO_RLE)) track_section(hist->second);
+}
+
+// follow lock nesting to find the boundaries of critical sections
+// called after each event is added to the thread's history
+void tracer::track_section(thrd_rec& rec) {
+	switch (rec.hist.back().ev) {
+	case (event::LOCK_REQ):
+		if (rec.depth == 0 && rec.cs_start == SIZE_MAX)
+			rec.cs_start = rec.hist.size() - 1;
+		break;
+	case (event::LOCK_ACQ):
+		// relock after a condvar wait does not add depth
+		if (rec.cond_wait) rec.cond_wait = false;
+		else ++rec.depth;
+		break;
+	case (event::LOCK_ERR):
+		// failed (try)lock outside of any section abandons it
+		if (rec.depth == 0) rec.cs_start = SIZE_MAX;
+		break;
+	case (event::LOCK_REL):
+		if (rec.cond_wait || rec.depth == 0) break;
+		--rec.depth;
+		if (rec.depth == 0 && rec.cs_start != SIZE_MAX) close_section(rec);
+		break;
+	case (event::COND_WAIT):
+		rec.cond_wait = true;
+		break;
+	case (event::COND_ERR):
+		rec.cond_wait = false;
+		break;
+	default:
+		break;
+	}
+}
+
+// a closed section that immediately follows the previous one and matches
+// its shape (event codes, objects, callers, stacks & cpus) is replaced by a single SECT_RPT
+// entry carrying the start time and section length; the remaining timestamps
+// are kept as deltas in rpt_deltas
+void tracer::close_section(thrd_rec& rec) {
+	vector<hist_entry>& hist = rec.hist;
+	size_t len = hist.size() - rec.cs_start;
+	bool rpt = (rec.cs_start == rec.last_end && len == rec.shape_len);
+	for (size_t i = 0; rpt && i < len; ++i) {
+		const hist_entry& a = hist[rec.shape_start + i];
+		const hist_entry& b = hist[rec.cs_start + i];
+		rpt = (a.ev == b.ev && a.addr == b.addr && a.caller == b.caller
+			&& a.ctx == b.ctx && a.cpu == b.cpu);
+		// deltas that do not fit are recorded in full
+		if (i > 0) rpt = rpt && (b.ts - hist[rec.cs_start + i - 1].ts).count()
+			<= (decltype(b.ts)::rep) UINT32_MAX;
+	}
+
+	if (rpt) {
+		for (size_t i = 1; i < len; ++i)
+			rec.rpt_deltas.push_back((uint32_t) (hist[rec.cs_start + i].ts
+				- hist[rec.cs_start + i - 1].ts).count());
+		auto start_ts = hist[rec.cs_start].ts;
+		hist.erase(hist.begin() + rec.cs_start, hist.end());
+		hist.emplace_back(event::SECT_RPT, len, nullptr);
+		hist.back().ts = start_ts;
+		// the room of a long folded section is given back once the history
+		// is well below it, or it would stay allocated for the thread's life
+		if (hist.size() < hist.capacity() / 4) hist.shrink_to_fit();
+	} else { // this section becomes the shape to match
+		rec.shape_start = rec.cs_start;
+		rec.shape_len = len;
+	}
+	rec.last_end = hist.size();
+	rec.cs_start = SIZE_MAX;
 }
 
 /*-----------------class hist_entry----------------------------*/
@@ -239,19 +590,17 @@ size_t hist_entry::end_addr = 0;
 size_t hist_entry::alloc_start = 0;
 size_t hist_entry::alloc_end = 0;
 unsigned int hist_entry::trace_skip = 0;
+unsigned int hist_entry::stack_depth = 0;
+bool hist_entry::record_cpu = false;
 
 // how many frames up to look for calling code
 #define TRACE_DEPTH 8
 
-hist_entry::hist_entry(event e, size_t obj_addr) : 
-	ts(chrono::steady_clock::now()), ev(e), addr(obj_addr) {
-
+int hist_entry::caller_frame(void** buf, int v) {
 	// these are set in the tracer ctor	
 	assert(start_addr && end_addr);
 	assert(alloc_start && alloc_end);
 		
-	void* buf[TRACE_DEPTH];
-	int v = backtrace(buf, TRACE_DEPTH);
 	int a = 0;
 	// find first frame outside of our own code
 	while (a < v && start_addr < (size_t) buf[a] &&
@@ -259,17 +608,44 @@ hist_entry::hist_entry(event e, size_t obj_addr) :
 	// skip requested amount of frames
 	a += trace_skip;
 	if (a >= v) a = v-1;
-	caller = buf[a];
 
-	if ((size_t) caller > alloc_start &&
-			(size_t) caller < alloc_end) throw std::bad_alloc();
+	if ((size_t) buf[a] > alloc_start &&
+			(size_t) buf[a] < alloc_end) throw std::bad_alloc();
+	return a;
+}
+
+// glibc reads the cpu from the rseq area or the vDSO, without a system call
+uint16_t hist_entry::cur_cpu() {
+	if (!record_cpu) return NO_CPU;
+	int c = sched_getcpu();
+	return (c < 0 || c >= NO_CPU) ? NO_CPU : (uint16_t) c;
+}
+
+hist_entry::hist_entry(event e, size_t obj_addr) : 
+	ts(chrono::steady_clock::now()), ev(e), cpu(cur_cpu()), ctx(0), addr(obj_addr) {
+	void* buf[TRACE_DEPTH];
+	int v = backtrace(buf, TRACE_DEPTH);
+	caller = buf[caller_frame(buf, v)];
+}
+
+// the stack is the caller and up to stack_depth-1 frames above it, interned
+// from the outermost frame in
+hist_entry::hist_entry(event e, size_t obj_addr, calling_context& cct) :
+	ts(chrono::steady_clock::now()), ev(e), cpu(cur_cpu()), ctx(0), addr(obj_addr) {
+	void* buf[TRACE_DEPTH + MAX_STACK_DEPTH];
+	int v = backtrace(buf, TRACE_DEPTH + stack_depth);
+	int a = caller_frame(buf, v);
+	caller = buf[a];
+	for (int f = std::min(v, a + (int) stack_depth); f-- > a;)
+		ctx = cct.intern(ctx, (size_t) buf[f]);
 }
 
 // ctor overload to manually set caller addr rather than looking it up
 // used when spawning threads; obviously, we can't stack trace
 // from within a thread to the code that created it
 hist_entry::hist_entry(event e, size_t obj_addr, void* c) :
-	ts(chrono::steady_clock::now()), ev(e), caller(c), addr(obj_addr) {}
+	ts(chrono::steady_clock::now()), ev(e), cpu(cur_cpu()), ctx(0), caller(c),
+	addr(obj_addr) {}
 
 } // namespace lktrace
 
@@ -22,6 +22,8 @@
 #include <execinfo.h> // backtrace()
 #include <unistd.h>  // free()
 #include <pthread.h> // pthread_self()
+#include <sched.h> // sched_getcpu()
+#include <dirent.h> // opendir() (cpu topology)
 
 #include <sys/mman.h> // mmap()
 #include <sys/stat.h>
@@ -44,20 +46,57 @@
 #include <cds/container/michael_kvlist_nogc.h>
 
 #include "event.h"
+#include "tracefmt.h"
 
 namespace lktrace {
 
 using namespace std;
+
+// frames recorded per stack, at most (see lktrace --stack-depth)
+#define MAX_STACK_DEPTH 64
+
+// calling-context tree of a thread's stacks: node 0 is the root, and each
+// other node is a frame under its parent (the frame that called it), so a
+// whole stack is kept as the id of its innermost frame's node
+// children are found through sibling lists, which are short in practice
+struct calling_context {
+	struct node {
+		size_t pc;
+		uint32_t parent;
+		uint32_t child; // first child (0 = none)
+		uint32_t sibling; // next child of the parent (0 = none)
+	};
+	vector<node> nodes;
+
+	calling_context() : nodes(1, node{0, 0, 0, 0}) {}
+
+	// the node of frame pc under parent, added if new
+	uint32_t intern (uint32_t parent, size_t pc) {
+		uint32_t* link = &nodes[parent].child;
+		while (*link) {
+			if (nodes[*link].pc == pc) return *link;
+			link = &nodes[*link].sibling;
+		}
+		uint32_t id = (uint32_t) nodes.size();
+		*link = id; // before nodes grows
+		nodes.push_back({pc, parent, 0, 0});
+		return id;
+	}
+};
 			
 // thread history entry
 struct hist_entry {
 	std::chrono::time_point<std::chrono::steady_clock> ts;
 	event ev;
+	uint16_t cpu; // cpu the event ran on (NO_CPU if not recorded)
+	uint32_t ctx; // calling context node (0 if the stack was not recorded)
 	void* caller;
 	size_t addr;
 
 	// ctor that looks up caller	
 	hist_entry(event, size_t);
+	// ctor that also records the stack in a calling context tree
+	hist_entry(event, size_t, calling_context&);
 	// pass in caller to ctor
 	hist_entry(event, size_t, void*);
 
@@ -71,13 +110,28 @@ struct hist_entry {
 	static size_t alloc_end;
 	// number of frames to skip after exiting our own code in a stack trace
 	static unsigned int trace_skip;
+	// frames recorded per stack (0 = only the caller, without a stack)
+	static unsigned int stack_depth;
+	// record the cpu of each event
+	static bool record_cpu;
+
+	// frame of the caller in a backtrace buf of v frames
+	static int caller_frame(void**, int);
+	// cpu of the calling thread, if recording cpus
+	static uint16_t cur_cpu();
 };
 
+// option flags passed from lktrace to the tracer
+enum ctl_flag : uint32_t {CTL_NONE = 0x0, CTL_NO_RLE = 0x1, CTL_TEXT = 0x2,
+	CTL_COMPRESS = 0x4, CTL_CPU = 0x8};
+
 // this class encapsulates access to tracer options stored
 // in shared memory
 class tracer_ctl {
 	private:
 	unsigned tskip;
+	uint32_t flags;
+	unsigned depth;
 	const char* prefix;
 	const char* wrdir;
 	const char* tdir;
@@ -86,15 +140,36 @@ class tracer_ctl {
 	tracer_ctl();	
 
 	unsigned get_tskip() const {return tskip;}
+	unsigned get_depth() const {return depth;}
+	bool get_flag(ctl_flag f) const {return flags & f;}
+	uint32_t get_flags() const {return flags;}
 	std::string get_prefix() const {return std::string(prefix);}
 	const char* get_wrdir() const {return wrdir;}
 	const char* get_tdir() const {return tdir;}
 };
 
-// history type (concurrent hash map from tids to vectors of hist_entry)
+// per-thread trace record
+struct thrd_rec {
+	vector<hist_entry> hist;
+	// timing deltas of the critical sections folded into SECT_RPT entries,
+	// in record order (see close_section())
+	vector<uint32_t> rpt_deltas;
+	// stacks of the thread's events (with --stack-depth)
+	calling_context cct;
+
+	// run-length compression state
+	unsigned depth = 0; // number of currently held locks
+	bool cond_wait = false; // between COND_WAIT and the matching relock
+	size_t cs_start = SIZE_MAX; // index of the open critical section in hist
+	size_t shape_start = 0; // last fully recorded critical section
+	size_t shape_len = 0;
+	size_t last_end = SIZE_MAX; // end of the last recorded or repeated section
+};
+
+// history type (concurrent hash map from tids to thread records)
 // does not support removing entries bcs garbage collection is turned off
 using hist_map = cds::container::MichaelHashMap<cds::gc::nogc,
-      cds::container::MichaelKVList<cds::gc::nogc, size_t, vector<hist_entry> > >;
+      cds::container::MichaelKVList<cds::gc::nogc, size_t, thrd_rec> >;
 
 class tracer {	
 	// indicator that constructor has completed
@@ -110,6 +185,8 @@ class tracer {
 	
 	// time zero
 	const chrono::time_point<chrono::steady_clock> init_time;
+	// wall clock time at time zero (for the trace header)
+	const chrono::time_point<chrono::system_clock> init_real;
 
 	// register thread with libcds tracking
 	static void cds_register_thread();
@@ -121,6 +198,16 @@ class tracer {
 	// instance socket (liveness is used by master for instance counting)
 	int instance_sock;
 
+	// track critical sections in a thread's history, and fold a section
+	// that exactly repeats the previous one into a SECT_RPT entry
+	void track_section(thrd_rec&);
+	void close_section(thrd_rec&);
+
+	// write out histories (called from dtor)
+	std::unordered_map<size_t, std::string> resolve_names();
+	void write_text(ofstream&);
+	void write_binary(ofstream&);
+
 	public:
 	tracer();
 	~tracer();
@@ -0,0 +1,145 @@
+// thread utilization for sizing thread pools: the share of each thread's
+// lifetime, spawn to exit, spent running, waiting for locks and waiting on
+// condvars (see util_scanner), totaled per thread hook, and the mean number
+// of a hook's threads in each state, overall and on a timeline of buckets
+// threads are scanned in one pass each, in parallel, and their totals are
+// then merged by hook, like find_flame()
+#include "parser.h"
+#include "parallel.h"
+
+#include <map>
+#include <algorithm> // sort()
+
+namespace lktrace {
+
+namespace {
+
+const char* const state_names[UTIL_STATES] = {"running", "waiting for locks",
+	"waiting on condvars"};
+
+size_t total (const size_t (&ticks)[UTIL_STATES]) {
+	size_t n = 0;
+	for (size_t s = 0; s < UTIL_STATES; ++s) n += ticks[s];
+	return n;
+}
+
+// percentage of time in each state, of n ticks
+void put_states (std::ostream& outs, const size_t* ticks, size_t n) {
+	for (size_t s = 0; s < UTIL_STATES; ++s) {
+		outs << ((s == 0) ? "" : ", ") << state_names[s] << ' ';
+		put_ratio(outs, ticks[s] * 100, n);
+		outs << '%';
+	}
+}
+
+} // namespace
+
+void parser::find_utilization (size_t buckets) {
+	buckets = std::max<size_t>(buckets, 1);
+	set_timeline(buckets);
+	std::vector<util_scanner> U (thrds.size(), util_scanner(tl_begin, tl_width, buckets));
+	parallel_for(thrds.size(), [&] (size_t t) {
+		for (size_t i = thrds[t].begin; i < thrds[t].end; ++i)
+			U[t].add(store.ev[i], store.ts[i]);
+	});
+	merge_utilization(U);
+}
+
+// merge the per-thread totals into util, by process and hook
+void parser::merge_utilization (std::vector<util_scanner>& U) {
+	std::map<std::pair<uint64_t, std::string_view>, util_stats> hooks;
+	for (size_t t = 0; t < U.size(); ++t) {
+		if (U[t].first == SIZE_MAX) continue;
+		uint64_t pid = (thrd_pids.empty()) ? 0 : thrd_pids[t];
+		auto [it, fresh] = hooks.try_emplace({pid, thrd_hooks[t]});
+		util_stats& S = it->second;
+		if (fresh) {
+			S.pid = pid;
+			S.hook = thrd_hooks[t];
+			S.first = U[t].first;
+			S.last = U[t].last;
+			for (size_t s = 0; s < UTIL_STATES; ++s) {
+				S.ticks[s] = 0;
+				S.b_ticks[s].assign(U[t].b_ticks[s].size(), 0);
+			}
+		}
+		S.first = std::min(S.first, U[t].first);
+		S.last = std::max(S.last, U[t].last);
+		std::array<size_t, UTIL_STATES> ticks;
+		for (size_t s = 0; s < UTIL_STATES; ++s) {
+			ticks[s] = U[t].ticks[s];
+			S.ticks[s] += ticks[s];
+			for (size_t k = 0; k < S.b_ticks[s].size(); ++k)
+				S.b_ticks[s][k] += U[t].b_ticks[s][k];
+			std::vector<size_t>().swap(U[t].b_ticks[s]);
+		}
+		S.thrds.emplace_back((uint32_t) t, ticks);
+	}
+	util.clear();
+	for (auto& h : hooks) util.push_back(std::move(h.second));
+	std::stable_sort(util.begin(), util.end(), [] (const util_stats& a, const util_stats& b) {
+		return total(a.ticks) > total(b.ticks);
+	});
+}
+
+// per hook: its threads' time in each state, the mean number of them in
+// each state over the hook's span, whether waiters outnumber runners, and
+// each thread's own shares
+void parser::dump_utilization (std::ostream& outs) {
+	for (const util_stats& S : util) {
+		size_t n = total(S.ticks), span = S.last - S.first;
+		outs << "Hook " << S.hook;
+		if (!thrd_pids.empty()) outs << " (process " << S.pid << ')';
+		outs << ": " << S.thrds.size() << " thread(s), " << to_ns(n) << " ns of thread time\n\t";
+		put_states(outs, S.ticks, n);
+		outs << "\n\tmean threads over " << to_ns(span) << " ns: ";
+		put_ratio(outs, n, span);
+		outs << " alive";
+		for (size_t s = 0; s < UTIL_STATES; ++s) {
+			outs << ", ";
+			put_ratio(outs, S.ticks[s], span);
+			outs << ' ' << state_names[s];
+		}
+		outs << '\n';
+		if (S.ticks[UTIL_LOCK] > S.ticks[UTIL_RUN])
+			outs << "\tmore threads wait for locks than run: adding threads would mostly add"
+				" lock waiters\n";
+		else if (S.ticks[UTIL_LOCK] + S.ticks[UTIL_COND] > S.ticks[UTIL_RUN])
+			outs << "\tmore threads wait than run, mostly on condvars: adding threads would"
+				" mostly add idle ones\n";
+		for (auto& [t, ticks] : S.thrds) {
+			size_t life = ticks[UTIL_RUN] + ticks[UTIL_LOCK] + ticks[UTIL_COND];
+			outs << "\tthread 0x" << std::hex << thrds[t].tid << std::dec << ": " << to_ns(life)
+				<< " ns, ";
+			put_states(outs, ticks.data(), life);
+			outs << '\n';
+		}
+		outs << '\n';
+	}
+}
+
+// one row per hook and bucket: the bucket's start and end (ns), and the
+// mean number of the hook's threads alive and in each state in it
+void parser::dump_utilization_csv (std::ostream& outs) {
+	outs << "hook,begin_ns,end_ns,alive,running,lock_wait,cond_wait\n";
+	for (const util_stats& S : util) {
+		// quoted, as demangled names may hold commas
+		std::string hook = "\"";
+		if (!thrd_pids.empty()) hook += "process " + std::to_string(S.pid) + ';';
+		for (char c : S.hook) hook += (c == '"') ? "\"\"" : std::string(1, c);
+		hook += '"';
+		for (size_t k = 0; k < S.b_ticks[0].size(); ++k) {
+			size_t b = tl_begin + k * tl_width, alive = 0;
+			for (size_t s = 0; s < UTIL_STATES; ++s) alive += S.b_ticks[s][k];
+			outs << hook << ',' << to_ns(b) << ',' << to_ns(b + tl_width) << ',';
+			put_ratio(outs, alive, tl_width);
+			for (size_t s = 0; s < UTIL_STATES; ++s) {
+				outs << ',';
+				put_ratio(outs, S.b_ticks[s][k], tl_width);
+			}
+			outs << '\n';
+		}
+	}
+}
+
+} // namespace lktrace